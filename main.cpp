@@ -6,12 +6,24 @@
 #include <commctrl.h>
 #include <strsafe.h>
 #include <objbase.h>
+#include <bcrypt.h>
+#include <sddl.h>
 
 #include <functional>
 #include <vector>
 #include <codecvt>
 #include <string>
 #include <ctime>
+#include <map>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <type_traits>
+#include <new>
+#include <memory>
 
 #include "pluginapi.h"
 #include "blockingconcurrentqueue.h"
@@ -157,452 +169,8069 @@ tstring wstring_to_tstring(const std::wstring& str)
 #endif
 }
 
+template <typename T>
+tstring to_tstring(T value)
+{
+#ifdef UNICODE
+	return std::to_wstring(value);
+#else
+	return std::to_string(value);
+#endif
+}
+
 ///////////////////////////////////////////////////////////////////////
-// Queue
+// Stats
 ///////////////////////////////////////////////////////////////////////
 
-typedef std::function<void()> taskQueueItem_t;
-static moodycamel::BlockingConcurrentQueue<taskQueueItem_t> g_TaskQueue;
-static volatile bool g_taskConsumersKeepRunning = true;
-static volatile bool g_taskConsumersGracefulShutdown = true;
-static std::vector<std::thread> g_taskConsumers;
+// Where the time of a request goes, see Timing
+enum http_phase_t {
+	HTTP_PHASE_QUEUE, // from queueing to a worker starting it
+	HTTP_PHASE_DNS,
+	HTTP_PHASE_CONNECT, // WinINet's TCP connect; a Happy Eyeballs race is in no phase
+	HTTP_PHASE_TLS, // from the TCP connection to sending the request
+	HTTP_PHASE_SEND,
+	HTTP_PHASE_FIRST_BYTE, // from the request sent to the response headers
+	HTTP_PHASE_TRANSFER, // reading the body
+	HTTP_PHASE_COUNT,
+};
 
-static void TaskConsumersShutdown(bool graceful)
-{
-	g_taskConsumersGracefulShutdown = graceful;
-	g_taskConsumersKeepRunning = false;
+// Process-wide counters reported by HttpGetStats. Only ever incremented,
+// so relaxed atomics are enough.
+struct http_stats_t {
+	std::atomic<unsigned long long> tlsHandshakes;
+	std::atomic<unsigned long long> tlsConnectionsReused;
+	std::atomic<unsigned long long> queueDroppedOldest;
+	std::atomic<unsigned long long> queueRejected;
+	std::atomic<unsigned long long> queueSpilled;
+	std::atomic<unsigned long long> queueDequeued[3]; // one per task_priority_t
+	std::atomic<unsigned long long> taskHeapAllocations;
+	std::atomic<unsigned long long> tasksSpawnedLocal;
+	std::atomic<unsigned long long> tasksStolen;
+	std::atomic<unsigned long long> tasksExpired;
+	std::atomic<unsigned long long> tasksCancelled;
+	std::atomic<unsigned long long> cacheHits; // served fresh, no request
+	std::atomic<unsigned long long> cacheRevalidated; // served after a 304
+	std::atomic<unsigned long long> cacheMisses;
+	std::atomic<unsigned long long> cacheBytesSaved;
+	std::atomic<unsigned long long> storeHits; // placed from the component store
+	std::atomic<unsigned long long> storeMisses; // downloaded into the store
+	std::atomic<unsigned long long> singleFlightShared; // joined an identical request in flight
+	std::atomic<unsigned long long> hedgeWins; // the hedge finished first
+	std::atomic<unsigned long long> mirrorFailovers; // a download moved on from a failed mirror
+	std::atomic<unsigned long long> segmentedDownloads;
+	std::atomic<unsigned long long> circuitBreakerTrips;
+	std::atomic<unsigned long long> circuitBreakerSpooled; // held back while the host's breaker was open
+	std::atomic<unsigned long long> circuitBreakerDropped;
+	std::atomic<unsigned long long> hostRateThrottled; // 429s and 503s with Retry-After
+	std::atomic<unsigned long long> hostRateRetries;
+	std::atomic<unsigned long long> phaseMicroseconds[HTTP_PHASE_COUNT];
+	std::atomic<unsigned long long> phaseSamples[HTTP_PHASE_COUNT];
+	std::atomic<unsigned long long> requests;
+	std::atomic<unsigned long long> bytesSent;
+	std::atomic<unsigned long long> bytesReceived;
+	std::atomic<unsigned long long> errorsTransport; // no response at all
+	std::atomic<unsigned long long> errorsClient; // 4xx
+	std::atomic<unsigned long long> errorsServer; // 5xx
+	std::atomic<unsigned long long> queueDepthHighWater;
+};
 
-	for (int i = 0; i < g_taskConsumers.size(); ++i) {
-		if (g_taskConsumers[i].joinable()) {
-			g_taskConsumers[i].join();
-		}
-	}
+static http_stats_t g_stats;
 
-	g_taskConsumers.clear();
+static void StatsIncrement(std::atomic<unsigned long long>& counter, unsigned long long value = 1)
+{
+	counter.fetch_add(value, std::memory_order_relaxed);
 }
 
-static void TaskConsumersInit(size_t numWorkers)
+static unsigned long long StatsGet(const std::atomic<unsigned long long>& counter)
 {
-	TaskConsumersShutdown(false);
+	return counter.load(std::memory_order_relaxed);
+}
 
-	g_taskConsumersKeepRunning = true;
-	g_taskConsumersGracefulShutdown = true;
+static void StatsMax(std::atomic<unsigned long long>& counter, unsigned long long value)
+{
+	unsigned long long current = counter.load(std::memory_order_relaxed);
 
-	for (int i = 0; i < numWorkers; ++i) {
-		g_taskConsumers.emplace_back(std::thread([]() {
-			taskQueueItem_t task;
+	while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+}
 
-			while (g_taskConsumersKeepRunning || (g_TaskQueue.size_approx() && g_taskConsumersGracefulShutdown)) {
-				if (g_TaskQueue.wait_dequeue_timed(task, std::chrono::milliseconds(100))) {
-					task();
-				}
-			}
-		}));
+// Appends "name":value to a JSON object being built in `json`, which must
+// already contain the opening brace.
+static void JsonAppendField(std::string& json, const char* name, const std::string& value)
+{
+	if (json.back() != '{') {
+		json += ",";
 	}
+
+	json += "\"";
+	json += name;
+	json += "\":";
+	json += value;
 }
 
-static void EnqueueTask(taskQueueItem_t task)
+static void JsonAppendField(std::string& json, const char* name, unsigned long long value)
 {
-	g_TaskQueue.enqueue(task);
+	JsonAppendField(json, name, std::to_string(value));
 }
 
 ///////////////////////////////////////////////////////////////////////
-// HTTP
+// Timing
 ///////////////////////////////////////////////////////////////////////
 
-static const TCHAR* DEFAULT_USER_AGENT = TEXT("NSIS HTTP Client");
+// Every request records where its time went, from QueryPerformanceCounter
+// readings taken at WinINet's status notifications and around the send and
+// read calls. Each phase's duration is added to the request's context on
+// the stack as the phase ends, and once the request is over the sums are
+// added to the process-wide totals and, for async requests with an id,
+// published with the request's progress. The phases are declared with the
+// stats.
+static const char* HTTP_PHASE_NAMES[HTTP_PHASE_COUNT] = { "queue", "dns", "connect", "tls", "send", "first_byte", "transfer" };
 
-unsigned long g_configConnectTimeoutMilliseconds = 5000;
-unsigned long g_configRequestTimeoutMilliseconds = 5000;
-unsigned long g_configResponseTimeoutMilliseconds = 5000;
-tstring g_userAgent = DEFAULT_USER_AGENT;
+struct http_timing_t {
+	unsigned long long microseconds[HTTP_PHASE_COUNT];
+	bool measured[HTTP_PHASE_COUNT];
+};
 
-typedef std::function<bool(const TCHAR* headers, const void* buffer, size_t buffer_len)> http_response_callback_t;
+static LONGLONG TimingNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
 
-static BOOL HttpRequest(
-	const TCHAR* verb,
-	const TCHAR* url,
-	const TCHAR* user_agent = NULL,
-	const TCHAR* request_headers_crlf = NULL,
-	const size_t request_headers_crlf_chars_len = 0,
-	const void* request_content = NULL,
-	const size_t request_content_bytes_len = 0,
-	http_response_callback_t responseCallback = NULL)
+	return now.QuadPart;
+}
+
+static LONGLONG TimingFrequency()
 {
-	HINTERNET hInternet = NULL;
-	HINTERNET hConnect = NULL;
-	HINTERNET hRequest = NULL;
-	BOOL bResult = FALSE;
-	
-	unsigned long g_configMaxConnectionsPerServer = g_taskConsumers.size() ? g_taskConsumers.size() : 4;
-	BOOL g_configHttpDecoding = TRUE;
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
 
-	URL_COMPONENTS urlComponents;
-	memset(&urlComponents, 0, sizeof(urlComponents));
-	urlComponents.dwStructSize = sizeof(urlComponents);
-	urlComponents.dwSchemeLength = 64;
-	urlComponents.dwHostNameLength = 1024;
-	urlComponents.dwUserNameLength = 1024;
-	urlComponents.dwPasswordLength = 1024;
-	urlComponents.dwUrlPathLength = 32768;
+	return frequency.QuadPart;
+}
 
-	urlComponents.lpszScheme = new TCHAR[urlComponents.dwSchemeLength];
-	urlComponents.lpszHostName = new TCHAR[urlComponents.dwHostNameLength];
-	urlComponents.lpszUserName = new TCHAR[urlComponents.dwUserNameLength];
-	urlComponents.lpszPassword = new TCHAR[urlComponents.dwPasswordLength];
-	urlComponents.lpszUrlPath = new TCHAR[urlComponents.dwUrlPathLength];
+// Sets a phase from two TimingNow() readings, if both were taken in order
+static void TimingSetPhase(http_timing_t& timing, http_phase_t phase, LONGLONG from, LONGLONG to)
+{
+	static const LONGLONG frequency = TimingFrequency();
 
-	if (!InternetCrackUrl(url, _tcsclen(url), ICU_DECODE, &urlComponents)) {
-		goto failed_parse_url;
+	if (!from || to < from) {
+		return;
 	}
 
-	hInternet =
-		InternetOpen(
-			user_agent ? user_agent : DEFAULT_USER_AGENT,
-			INTERNET_OPEN_TYPE_PRECONFIG,
-			NULL,
-			NULL,
-			0);
+	timing.microseconds[phase] += (unsigned long long)((to - from) * 1000000 / frequency);
+	timing.measured[phase] = true;
+}
 
-	if (!hInternet) {
-		goto failed_internet_open;
-	}
+// Adds the measured phases to the totals and to perRequest, which may be NULL
+static void TimingRecord(const http_timing_t& timing, std::atomic<unsigned long long>* perRequest)
+{
+	for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+		if (!timing.measured[phase]) {
+			continue;
+		}
 
-	InternetSetOption(hInternet, INTERNET_OPTION_CONNECT_TIMEOUT, &g_configConnectTimeoutMilliseconds, sizeof(g_configConnectTimeoutMilliseconds));
+		StatsIncrement(g_stats.phaseMicroseconds[phase], timing.microseconds[phase]);
+		StatsIncrement(g_stats.phaseSamples[phase]);
 
-	InternetSetOption(hInternet, INTERNET_OPTION_SEND_TIMEOUT, &g_configRequestTimeoutMilliseconds, sizeof(g_configRequestTimeoutMilliseconds));
-	InternetSetOption(hInternet, INTERNET_OPTION_CONTROL_SEND_TIMEOUT, &g_configRequestTimeoutMilliseconds, sizeof(g_configRequestTimeoutMilliseconds));
+		if (perRequest) {
+			perRequest[phase] = timing.microseconds[phase];
+		}
+	}
+}
 
-	InternetSetOption(hInternet, INTERNET_OPTION_RECEIVE_TIMEOUT, &g_configResponseTimeoutMilliseconds, sizeof(g_configResponseTimeoutMilliseconds));
-	InternetSetOption(hInternet, INTERNET_OPTION_CONTROL_RECEIVE_TIMEOUT, &g_configResponseTimeoutMilliseconds, sizeof(g_configResponseTimeoutMilliseconds));
-		
-	InternetSetOption(hInternet, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &g_configMaxConnectionsPerServer, sizeof(g_configMaxConnectionsPerServer));
-	InternetSetOption(hInternet, INTERNET_OPTION_IGNORE_OFFLINE, NULL, 0);
+static std::string TimingToJson()
+{
+	std::string json = "{";
 
-	// https://docs.microsoft.com/en-us/windows/desktop/WinInet/content-encoding
-	InternetSetOption(hInternet, INTERNET_OPTION_HTTP_DECODING, &g_configHttpDecoding, sizeof(g_configHttpDecoding));
+	for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+		unsigned long long total = StatsGet(g_stats.phaseMicroseconds[phase]);
+		unsigned long long samples = StatsGet(g_stats.phaseSamples[phase]);
 
-	hConnect = InternetConnect(
-			hInternet,
-			urlComponents.lpszHostName,
-			urlComponents.nPort,
-			urlComponents.dwUserNameLength ? urlComponents.lpszUserName : NULL,
-			urlComponents.dwPasswordLength ? urlComponents.lpszPassword : NULL,
-			INTERNET_SERVICE_HTTP,
-			0,
-			0);
+		std::string stats = "{";
+		JsonAppendField(stats, "samples", samples);
+		JsonAppendField(stats, "total_us", total);
+		JsonAppendField(stats, "average_us", samples ? total / samples : 0ULL);
+		stats += "}";
 
-	if (!hConnect) {
-		goto failed_session_connect;
+		JsonAppendField(json, HTTP_PHASE_NAMES[phase], stats);
 	}
 
+	json += "}";
 
-	hRequest =
-		HttpOpenRequest(
-			hConnect,
-			verb,
-			urlComponents.lpszUrlPath,
-			NULL,
-			NULL,
-			NULL,
-			INTERNET_FLAG_NO_CACHE_WRITE |
-			INTERNET_FLAG_NO_COOKIES |
-			INTERNET_FLAG_NO_UI |
-			INTERNET_FLAG_PRAGMA_NOCACHE |
-			INTERNET_FLAG_RELOAD | (urlComponents.nScheme == INTERNET_SCHEME_HTTPS ? INTERNET_FLAG_SECURE : 0L),
-			NULL);
+	return json;
+}
 
-	bResult =
-		HttpSendRequest(
-			hRequest,
-			request_headers_crlf,
-			request_headers_crlf_chars_len,
-			(LPVOID)request_content,
-			request_content_bytes_len);
+///////////////////////////////////////////////////////////////////////
+// Tracing
+///////////////////////////////////////////////////////////////////////
 
-	if (!bResult) {
-		goto http_request_failed;
+// Opt-in recording of the request pipeline as a Chrome trace (viewable in
+// chrome://tracing or Perfetto), enabled with HttpSetTracing. Requests add
+// how long they were queued as an async span, and their DNS, connect, TLS,
+// send, first byte and transfer phases plus the whole request as complete
+// events on the thread that ran them. Each request's events carry its id
+// and URL in their args, and the id also ties its queued span to the rest.
+// Events go into a fixed ring buffer:
+// writers claim a slot with one fetch_add and overwrite the oldest events
+// once it's full, and each slot carries a sequence number so a dump taken
+// while events are still being written skips the half-written ones. The
+// buffer is written out by HttpFlushAllAsyncRequests and on unload.
+//
+// Every trace point is guarded by TraceEnabled(), a single load of a flag,
+// so tracing costs one predictable branch while it's off.
+enum trace_event_type_t {
+	TRACE_COMPLETE, // "X" on the recording thread
+	TRACE_ASYNC, // a "b"/"e" pair, on a track of its own
+};
+
+struct trace_event_t {
+	std::atomic<unsigned long long> sequence; // slot index + 1 once written, 0 while being written
+	trace_event_type_t type;
+	const char* name; // string literal
+	LONGLONG start; // TimingNow() readings
+	LONGLONG end;
+	unsigned long long id; // the request's, 0 if unknown
+	char detail[128]; // the request's URL in UTF-8, truncated
+	DWORD threadId;
+};
+
+static const size_t TRACE_DEFAULT_EVENTS = 65536;
+
+static std::atomic<bool> g_traceEnabled(false);
+static trace_event_t* g_traceEvents = NULL; // allocated once, on first enable
+static size_t g_traceCapacity = 0;
+static std::atomic<unsigned long long> g_traceNext(0);
+static std::atomic<unsigned long long> g_traceNextId(0);
+static LONGLONG g_traceStart = 0;
+static tstring g_configTracePath;
+static std::mutex g_traceConfigMutex;
+
+static bool FileWriteAtomic(const tstring& path, const std::string& data);
+
+static bool TraceEnabled()
+{
+	// Acquire, so the buffer allocated before the flag was set is visible
+	return g_traceEnabled.load(std::memory_order_acquire);
+}
+
+static void TraceRecord(trace_event_type_t type, const char* name, LONGLONG start, LONGLONG end, unsigned long long id, const char* detail)
+{
+	if (!start || end < start) {
+		return;
 	}
 
-	if (responseCallback) {
-		DWORD headersBufSize = 0L;
-		HttpQueryInfo(hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &headersBufSize, NULL);
-		headersBufSize += sizeof(TCHAR);
-		TCHAR* headers = new TCHAR[headersBufSize / sizeof(TCHAR)];
-		
-		if (!HttpQueryInfo(hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, headers, &headersBufSize, NULL)) {
-			headers[0] = 0;
-		}
+	size_t detailLength = detail ? strlen(detail) : 0;
 
-		const size_t BUFFER_LEN = 32768;
-		char* buffer = new char[BUFFER_LEN];
-		
-		DWORD bytesRead = 0;
-		while (InternetReadFile(hRequest, buffer, BUFFER_LEN, &bytesRead)) {
-			if (!responseCallback(headers, buffer, bytesRead)) {
-				break;
-			}
+	if (detailLength >= sizeof(trace_event_t::detail)) {
+		detailLength = sizeof(trace_event_t::detail) - 1;
 
-			if (bytesRead < BUFFER_LEN) {
-				break;
-			}
+		// Don't cut a UTF-8 sequence in half
+		while (detailLength && (detail[detailLength] & 0xC0) == 0x80) {
+			--detailLength;
 		}
-
-		delete[] headers;
-		delete[] buffer;
 	}
 
-http_request_failed:
-	InternetCloseHandle(hRequest);
+	unsigned long long index = g_traceNext.fetch_add(1, std::memory_order_relaxed);
+	trace_event_t& event = g_traceEvents[index % g_traceCapacity];
 
-failed_open_request:
-	InternetCloseHandle(hConnect);
+	event.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
 
-failed_session_connect:
-	InternetCloseHandle(hInternet);
+	event.type = type;
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	event.id = id;
+	if (detailLength) {
+		memcpy(event.detail, detail, detailLength);
+	}
+	event.detail[detailLength] = '\0';
+	event.threadId = GetCurrentThreadId();
 
-failed_internet_open:
-failed_parse_url:
-	delete[] urlComponents.lpszScheme;
-	delete[] urlComponents.lpszHostName;
-	delete[] urlComponents.lpszUserName;
-	delete[] urlComponents.lpszPassword;
-	delete[] urlComponents.lpszUrlPath;
+	event.sequence.store(index + 1, std::memory_order_release);
+}
 
-	return bResult;
+// Names a request in the events recorded for it
+static unsigned long long TraceNewId()
+{
+	return ++g_traceNextId;
 }
 
-///////////////////////////////////////////////////////////////////////
-// API
-///////////////////////////////////////////////////////////////////////
+static void TraceComplete(const char* name, LONGLONG start, LONGLONG end, unsigned long long id, const char* url)
+{
+	TraceRecord(TRACE_COMPLETE, name, start, end, id, url);
+}
 
-#define NSISFUNC(name) extern "C" void __declspec(dllexport) name(HWND hWndParent, int string_size, TCHAR* variables, stack_t** stacktop, extra_parameters* extra)
+// id must not be 0, as it is what pairs the span's begin and end events
+static void TraceAsync(const char* name, LONGLONG start, LONGLONG end, unsigned long long id, const char* url)
+{
+	TraceRecord(TRACE_ASYNC, name, start, end, id, url);
+}
 
-NSISFUNC(HttpPostString)
+// Starts recording into a buffer of maxEvents, or stops for an empty path.
+// Stopping keeps the last path, so what was recorded is still written out.
+// The buffer size is fixed by the first call that enables tracing.
+static void TraceConfigure(const tstring& path, size_t maxEvents)
 {
-	EXDLL_INIT();
+	std::lock_guard<std::mutex> lock(g_traceConfigMutex);
 
-	auto url = popstring();
-	auto contentType = popstring();
-	auto postContent = popstring();
+	if (path.empty()) {
+		g_traceEnabled = false;
+		return;
+	}
 
-	EnqueueTask([=]() {
-		if (url && contentType && postContent) {
-			tstring request_headers = TEXT("Content-Type: "); request_headers  += contentType;
-			std::string request_content = tchar_to_utf8(postContent);
+	g_configTracePath = path;
 
-			HttpRequest(
-				TEXT("POST"),
-				url,
-				NULL, // user-agent
-				request_headers.c_str(),
-				request_headers.size(),
-				request_content.c_str(),
-				request_content.size(),
-				NULL);
-		}
+	if (!g_traceEvents) {
+		g_traceCapacity = maxEvents ? maxEvents : TRACE_DEFAULT_EVENTS;
+		g_traceEvents = new trace_event_t[g_traceCapacity];
 
-		if (url) {
-			GlobalFree((HGLOBAL)url);
-		}
-		if (contentType) {
-			GlobalFree((HGLOBAL)contentType);
+		for (size_t i = 0; i < g_traceCapacity; ++i) {
+			g_traceEvents[i].sequence = 0;
 		}
-		if (postContent) {
-			GlobalFree((HGLOBAL)postContent);
-		}
-	});
 
-	if (url && contentType && postContent) {
-		pushstring(TEXT("ok"));
-	}
-	else {
-		pushstring(TEXT("error"));
+		g_traceStart = TimingNow();
 	}
+
+	g_traceEnabled.store(true, std::memory_order_release);
 }
 
-NSISFUNC(HttpPostStringWait)
+static std::string TraceTimestamp(LONGLONG counter)
 {
-	EXDLL_INIT();
-
-	auto url = popstring();
-	auto contentType = popstring();
-	auto postContent = popstring();
+	static const LONGLONG frequency = TimingFrequency();
 
-	tstring result;
+	return std::to_string(counter > g_traceStart ? (unsigned long long)((counter - g_traceStart) * 1000000 / frequency) : 0ULL);
+}
 
-	if (url && contentType && postContent) {
-		tstring request_headers = TEXT("Content-Type: "); request_headers += contentType;
-		std::string request_content = tchar_to_utf8(postContent);
-		std::string response_buffer;
+static void TraceAppendString(std::string& json, const char* value)
+{
+	json += "\"";
 
-		BOOL bResult = HttpRequest(
-			TEXT("POST"),
-			url,
-			NULL, // user-agent
-			request_headers.c_str(),
-			request_headers.size(),
-			request_content.c_str(),
-			request_content.size(),
-			[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
-				response_buffer.append((char*)buffer, buffer_len);
+	for (; *value; ++value) {
+		unsigned char c = (unsigned char)*value;
 
-				return true;
-			});
+		if (c == '"' || c == '\\') {
+			json += '\\';
+			json += (char)c;
+		}
+		else if (c < 0x20) {
+			static const char hex[] = "0123456789abcdef";
 
-		if (!bResult) {
-			result = TEXT("error");
+			json += "\\u00";
+			json += hex[c >> 4];
+			json += hex[c & 0xF];
 		}
 		else {
-			result = utf8_to_tstring(response_buffer);
+			json += (char)c;
 		}
 	}
 
-	if (url) {
-		GlobalFree((HGLOBAL)url);
-	}
-	if (contentType) {
-		GlobalFree((HGLOBAL)contentType);
-	}
-	if (postContent) {
-		GlobalFree((HGLOBAL)postContent);
+	json += "\"";
+}
+
+static void TraceAppendEvent(std::string& json, const char* name, const char* phase, LONGLONG ts, DWORD threadId, unsigned long long id, const char* detail)
+{
+	if (json.back() != '[') {
+		json += ",";
 	}
 
-	pushstring(result.c_str());
+	json += "{\"name\":\"";
+	json += name;
+	json += "\",\"cat\":\"http\",\"ph\":\"";
+	json += phase;
+	json += "\",\"ts\":";
+	json += TraceTimestamp(ts);
+	json += ",\"pid\":";
+	json += std::to_string(GetCurrentProcessId());
+	json += ",\"tid\":";
+	json += std::to_string(threadId);
+
+	if (id) {
+		json += ",\"args\":{\"request\":";
+		json += std::to_string(id);
+		json += ",\"url\":";
+		TraceAppendString(json, detail);
+		json += "}";
+	}
 }
 
-NSISFUNC(HttpGetStringWait)
+// Writes the buffered events to the trace file as Chrome trace JSON
+static void TraceDump()
 {
-	EXDLL_INIT();
+	std::lock_guard<std::mutex> lock(g_traceConfigMutex);
 
-	auto url = popstring();
-	auto contentType = popstring();
-	auto postContent = popstring();
+	if (!g_traceEvents || g_configTracePath.empty()) {
+		return;
+	}
 
-	tstring result;
+	static const LONGLONG frequency = TimingFrequency();
 
-	if (url && contentType && postContent) {
-		std::string response_buffer;
+	unsigned long long next = g_traceNext.load(std::memory_order_acquire);
+	unsigned long long first = next > g_traceCapacity ? next - g_traceCapacity : 0;
 
-		BOOL bResult = HttpRequest(
-			TEXT("GET"),
-			url,
+	std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	for (unsigned long long index = first; index < next; ++index) {
+		trace_event_t& slot = g_traceEvents[index % g_traceCapacity];
+
+		if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+			continue;
+		}
+
+		trace_event_type_t type = slot.type;
+		const char* name = slot.name;
+		LONGLONG start = slot.start;
+		LONGLONG end = slot.end;
+		unsigned long long id = slot.id;
+		char detail[sizeof(slot.detail)];
+		memcpy(detail, slot.detail, sizeof(detail));
+		detail[sizeof(detail) - 1] = '\0';
+		DWORD threadId = slot.threadId;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (slot.sequence.load(std::memory_order_relaxed) != index + 1) {
+			// Overwritten while we were reading it
+			continue;
+		}
+
+		if (type == TRACE_COMPLETE) {
+			TraceAppendEvent(json, name, "X", start, threadId, id, detail);
+			json += ",\"dur\":";
+			json += std::to_string((unsigned long long)((end - start) * 1000000 / frequency));
+			json += "}";
+		}
+		else {
+			TraceAppendEvent(json, name, "b", start, threadId, id, detail);
+			json += ",\"id\":" + std::to_string(id) + "}";
+			TraceAppendEvent(json, name, "e", end, threadId, 0, NULL);
+			json += ",\"id\":" + std::to_string(id) + "}";
+		}
+	}
+
+	json += "]}";
+
+	FileWriteAtomic(g_configTracePath, json);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Histograms
+///////////////////////////////////////////////////////////////////////
+
+// Latency histograms per host, for the total time of each request and each
+// timing phase, reported by HttpGetStats. Buckets are log-linear as in HDR
+// histograms: values below 8 us get a bucket each, and every power of two
+// above that is split into 8 buckets, so a bucket is never wider than an
+// eighth of its values (up to 2^32 us, beyond which values are clamped).
+// Recording is lock-free: every histogram is split into shards, each thread
+// adds to its own shard with relaxed atomics, and the shards are only summed
+// up when the stats are read. Hosts are found in a fixed open-addressing
+// table whose slots are claimed with a compare-and-swap; once it is full,
+// further hosts share an "other" entry.
+static const int HISTOGRAM_SERIES_TOTAL = HTTP_PHASE_COUNT; // after the phases
+static const int HISTOGRAM_SERIES = HTTP_PHASE_COUNT + 1;
+static const unsigned int HISTOGRAM_SUB_BUCKET_BITS = 3;
+static const unsigned int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+static const size_t HISTOGRAM_BUCKETS = (32 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+static const unsigned int HISTOGRAM_SHARDS = 4;
+static const size_t HISTOGRAM_HOSTS = 32;
+
+struct latency_histogram_t {
+	std::atomic<unsigned long long> counts[HISTOGRAM_BUCKETS];
+	std::atomic<unsigned long long> sum;
+	std::atomic<unsigned long long> max;
+};
+
+struct host_histograms_t {
+	tstring host; // fixed once published
+	latency_histogram_t shards[HISTOGRAM_SHARDS][HISTOGRAM_SERIES];
+
+	explicit host_histograms_t(const tstring& host) : host(host)
+	{
+		for (unsigned int shard = 0; shard < HISTOGRAM_SHARDS; ++shard) {
+			for (int series = 0; series < HISTOGRAM_SERIES; ++series) {
+				latency_histogram_t& histogram = shards[shard][series];
+
+				for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+					histogram.counts[bucket] = 0;
+				}
+
+				histogram.sum = 0;
+				histogram.max = 0;
+			}
+		}
+	}
+};
+
+static std::atomic<host_histograms_t*> g_hostHistograms[HISTOGRAM_HOSTS];
+static host_histograms_t g_hostHistogramsOther(TEXT("other"));
+static std::atomic<unsigned int> g_histogramNextShard(0);
+static thread_local unsigned int g_histogramShard = g_histogramNextShard++ % HISTOGRAM_SHARDS;
+
+static size_t HistogramBucket(unsigned long long value)
+{
+	if (value >> 32) {
+		value = 0xffffffffULL;
+	}
+
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return (size_t)value;
+	}
+
+	unsigned int exponent = 0;
+	unsigned long long x = value;
+
+	if (x >> 16) { x >>= 16; exponent += 16; }
+	if (x >> 8) { x >>= 8; exponent += 8; }
+	if (x >> 4) { x >>= 4; exponent += 4; }
+	if (x >> 2) { x >>= 2; exponent += 2; }
+	if (x >> 1) { exponent += 1; }
+
+	unsigned int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+	size_t subBucket = (size_t)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+// Largest value that lands in the bucket
+static unsigned long long HistogramBucketHighest(size_t bucket)
+{
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	unsigned int shift = (unsigned int)(bucket / HISTOGRAM_SUB_BUCKETS) - 1;
+	unsigned long long lowest = (unsigned long long)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+
+	return lowest + (1ULL << shift) - 1;
+}
+
+static host_histograms_t* HostHistogramsGet(const tstring& host)
+{
+	size_t start = std::hash<tstring>()(host) % HISTOGRAM_HOSTS;
+
+	for (size_t n = 0; n < HISTOGRAM_HOSTS; ++n) {
+		std::atomic<host_histograms_t*>& slot = g_hostHistograms[(start + n) % HISTOGRAM_HOSTS];
+		host_histograms_t* histograms = slot.load(std::memory_order_acquire);
+
+		if (!histograms) {
+			host_histograms_t* created = new host_histograms_t(host);
+
+			if (slot.compare_exchange_strong(histograms, created, std::memory_order_acq_rel)) {
+				return created;
+			}
+
+			// Another thread claimed the slot; histograms now holds its entry
+			delete created;
+		}
+
+		if (histograms->host == host) {
+			return histograms;
+		}
+	}
+
+	return &g_hostHistogramsOther;
+}
+
+static void HistogramRecord(host_histograms_t* histograms, int series, unsigned long long microseconds)
+{
+	latency_histogram_t& histogram = histograms->shards[g_histogramShard][series];
+
+	histogram.counts[HistogramBucket(microseconds)].fetch_add(1, std::memory_order_relaxed);
+	histogram.sum.fetch_add(microseconds, std::memory_order_relaxed);
+
+	StatsMax(histogram.max, microseconds);
+}
+
+// Adds the request's measured phases and, when total is set, its total time
+static void HistogramRecordTiming(const tstring& host, const http_timing_t& timing, bool hasTotal, unsigned long long totalMicroseconds)
+{
+	if (host.empty()) {
+		return;
+	}
+
+	host_histograms_t* histograms = HostHistogramsGet(host);
+
+	for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+		if (timing.measured[phase]) {
+			HistogramRecord(histograms, phase, timing.microseconds[phase]);
+		}
+	}
+
+	if (hasTotal) {
+		HistogramRecord(histograms, HISTOGRAM_SERIES_TOTAL, totalMicroseconds);
+	}
+}
+
+static std::string HistogramToJson(const host_histograms_t& histograms, int series)
+{
+	unsigned long long counts[HISTOGRAM_BUCKETS];
+	unsigned long long count = 0;
+	unsigned long long sum = 0;
+	unsigned long long max = 0;
+
+	for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+		counts[bucket] = 0;
+	}
+
+	for (unsigned int shard = 0; shard < HISTOGRAM_SHARDS; ++shard) {
+		const latency_histogram_t& histogram = histograms.shards[shard][series];
+
+		for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+			unsigned long long bucketCount = StatsGet(histogram.counts[bucket]);
+
+			counts[bucket] += bucketCount;
+			count += bucketCount;
+		}
+
+		sum += StatsGet(histogram.sum);
+
+		unsigned long long shardMax = StatsGet(histogram.max);
+		max = shardMax > max ? shardMax : max;
+	}
+
+	if (!count) {
+		return std::string();
+	}
+
+	static const double PERCENTILES[] = { 50, 90, 99, 99.9 };
+	static const char* PERCENTILE_NAMES[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+
+	std::string json = "{";
+	JsonAppendField(json, "count", count);
+	JsonAppendField(json, "mean_us", sum / count);
+
+	size_t bucket = 0;
+	unsigned long long seen = counts[0];
+
+	for (size_t i = 0; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++i) {
+		unsigned long long rank = (unsigned long long)(PERCENTILES[i] / 100 * count + 0.5);
+
+		if (rank < 1) {
+			rank = 1;
+		}
+
+		while (seen < rank && bucket + 1 < HISTOGRAM_BUCKETS) {
+			seen += counts[++bucket];
+		}
+
+		unsigned long long value = HistogramBucketHighest(bucket);
+
+		JsonAppendField(json, PERCENTILE_NAMES[i], value < max ? value : max);
+	}
+
+	JsonAppendField(json, "max_us", max);
+	json += "}";
+
+	return json;
+}
+
+static std::string HostHistogramsToJson(const host_histograms_t& histograms)
+{
+	std::string json = "{";
+
+	for (int series = 0; series < HISTOGRAM_SERIES; ++series) {
+		std::string histogram = HistogramToJson(histograms, series);
+
+		if (histogram.size()) {
+			JsonAppendField(json, series == HISTOGRAM_SERIES_TOTAL ? "total" : HTTP_PHASE_NAMES[series], histogram);
+		}
+	}
+
+	json += "}";
+
+	return json;
+}
+
+static std::string HistogramsToJson()
+{
+	std::string json = "{";
+
+	for (size_t slot = 0; slot < HISTOGRAM_HOSTS; ++slot) {
+		host_histograms_t* histograms = g_hostHistograms[slot].load(std::memory_order_acquire);
+
+		if (histograms) {
+			JsonAppendField(json, tchar_to_utf8(histograms->host.c_str()).c_str(), HostHistogramsToJson(*histograms));
+		}
+	}
+
+	std::string other = HostHistogramsToJson(g_hostHistogramsOther);
+
+	if (other != "{}") {
+		JsonAppendField(json, "other", other);
+	}
+
+	json += "}";
+
+	return json;
+}
+
+// Only once nothing records any more
+static void HistogramsFree()
+{
+	for (size_t slot = 0; slot < HISTOGRAM_HOSTS; ++slot) {
+		delete g_hostHistograms[slot].exchange(NULL);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Adaptive concurrency
+///////////////////////////////////////////////////////////////////////
+
+// Optional AIMD controller for the number of workers allowed to run tasks.
+// Completed requests are collected into windows; at the end of a window the
+// limit is cut by a quarter if the error rate exceeded 10% or the average
+// latency more than doubled against the best window seen (the baseline,
+// which slowly drifts up so it can follow a network that got slower), and
+// raised by one if the workers were saturated. Workers whose index is above
+// the limit stay idle instead of dequeuing.
+struct adaptive_concurrency_change_t {
+	ULONGLONG ticks;
+	size_t limit;
+};
+
+static const size_t ADAPTIVE_CONCURRENCY_HISTORY_SIZE = 32;
+static const ULONGLONG ADAPTIVE_CONCURRENCY_WINDOW_MILLISECONDS = 1000;
+
+static std::atomic<bool> g_adaptiveConcurrencyEnabled(false);
+static std::atomic<size_t> g_adaptiveConcurrencyLimit(0);
+static std::atomic<size_t> g_tasksInFlight(0);
+size_t g_configAdaptiveConcurrencyMin = 1;
+size_t g_configAdaptiveConcurrencyMax = 0;
+
+static std::mutex g_adaptiveConcurrencyMutex;
+static ULONGLONG g_adaptiveConcurrencyWindowStartTicks = 0;
+static size_t g_adaptiveConcurrencyWindowSamples = 0;
+static size_t g_adaptiveConcurrencyWindowErrors = 0;
+static size_t g_adaptiveConcurrencyWindowMaxInFlight = 0;
+static double g_adaptiveConcurrencyWindowLatencySum = 0;
+static double g_adaptiveConcurrencyBaselineLatency = 0;
+static ULONGLONG g_adaptiveConcurrencyStartTicks = 0;
+static std::deque<adaptive_concurrency_change_t> g_adaptiveConcurrencyHistory;
+
+// Callers hold g_adaptiveConcurrencyMutex
+static void AdaptiveConcurrencySetLimit(size_t limit)
+{
+	g_adaptiveConcurrencyLimit = limit;
+
+	adaptive_concurrency_change_t change = { GetTickCount64() - g_adaptiveConcurrencyStartTicks, limit };
+	g_adaptiveConcurrencyHistory.push_back(change);
+
+	if (g_adaptiveConcurrencyHistory.size() > ADAPTIVE_CONCURRENCY_HISTORY_SIZE) {
+		g_adaptiveConcurrencyHistory.pop_front();
+	}
+}
+
+static void AdaptiveConcurrencyEnable(size_t minLimit, size_t maxLimit)
+{
+	std::lock_guard<std::mutex> lock(g_adaptiveConcurrencyMutex);
+
+	g_configAdaptiveConcurrencyMin = minLimit;
+	g_configAdaptiveConcurrencyMax = maxLimit;
+
+	g_adaptiveConcurrencyStartTicks = GetTickCount64();
+	g_adaptiveConcurrencyWindowStartTicks = g_adaptiveConcurrencyStartTicks;
+	g_adaptiveConcurrencyWindowSamples = 0;
+	g_adaptiveConcurrencyWindowErrors = 0;
+	g_adaptiveConcurrencyWindowMaxInFlight = 0;
+	g_adaptiveConcurrencyWindowLatencySum = 0;
+	g_adaptiveConcurrencyBaselineLatency = 0;
+	g_adaptiveConcurrencyHistory.clear();
+
+	AdaptiveConcurrencySetLimit(minLimit);
+
+	g_adaptiveConcurrencyEnabled = true;
+}
+
+static void AdaptiveConcurrencyDisable()
+{
+	g_adaptiveConcurrencyEnabled = false;
+}
+
+static bool AdaptiveConcurrencyWorkerAllowed(size_t workerIndex)
+{
+	return !g_adaptiveConcurrencyEnabled || workerIndex < g_adaptiveConcurrencyLimit;
+}
+
+static void AdaptiveConcurrencyRecord(ULONGLONG latencyMilliseconds, bool success)
+{
+	if (!g_adaptiveConcurrencyEnabled) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(g_adaptiveConcurrencyMutex);
+
+	size_t inFlight = g_tasksInFlight;
+
+	++g_adaptiveConcurrencyWindowSamples;
+	g_adaptiveConcurrencyWindowLatencySum += (double)latencyMilliseconds;
+
+	if (!success) {
+		++g_adaptiveConcurrencyWindowErrors;
+	}
+
+	if (inFlight > g_adaptiveConcurrencyWindowMaxInFlight) {
+		g_adaptiveConcurrencyWindowMaxInFlight = inFlight;
+	}
+
+	ULONGLONG now = GetTickCount64();
+	size_t limit = g_adaptiveConcurrencyLimit;
+
+	if (now - g_adaptiveConcurrencyWindowStartTicks < ADAPTIVE_CONCURRENCY_WINDOW_MILLISECONDS &&
+		g_adaptiveConcurrencyWindowSamples < limit * 2) {
+		return;
+	}
+
+	double averageLatency = g_adaptiveConcurrencyWindowLatencySum / g_adaptiveConcurrencyWindowSamples;
+	double errorRate = (double)g_adaptiveConcurrencyWindowErrors / g_adaptiveConcurrencyWindowSamples;
+
+	if (!g_adaptiveConcurrencyBaselineLatency || averageLatency < g_adaptiveConcurrencyBaselineLatency) {
+		g_adaptiveConcurrencyBaselineLatency = averageLatency;
+	}
+	else {
+		g_adaptiveConcurrencyBaselineLatency *= 1.01;
+	}
+
+	size_t newLimit = limit;
+
+	if (errorRate > 0.1 || averageLatency > g_adaptiveConcurrencyBaselineLatency * 2) {
+		newLimit = limit - (limit + 3) / 4;
+	}
+	else if (g_adaptiveConcurrencyWindowMaxInFlight >= limit) {
+		newLimit = limit + 1;
+	}
+
+	if (newLimit < g_configAdaptiveConcurrencyMin) {
+		newLimit = g_configAdaptiveConcurrencyMin;
+	}
+	if (newLimit > g_configAdaptiveConcurrencyMax) {
+		newLimit = g_configAdaptiveConcurrencyMax;
+	}
+
+	if (newLimit != limit) {
+		AdaptiveConcurrencySetLimit(newLimit);
+	}
+
+	g_adaptiveConcurrencyWindowStartTicks = now;
+	g_adaptiveConcurrencyWindowSamples = 0;
+	g_adaptiveConcurrencyWindowErrors = 0;
+	g_adaptiveConcurrencyWindowMaxInFlight = 0;
+	g_adaptiveConcurrencyWindowLatencySum = 0;
+}
+
+static std::string AdaptiveConcurrencyToJson(size_t workers)
+{
+	std::lock_guard<std::mutex> lock(g_adaptiveConcurrencyMutex);
+
+	std::string history = "[";
+
+	for (size_t i = 0; i < g_adaptiveConcurrencyHistory.size(); ++i) {
+		if (i) {
+			history += ",";
+		}
+
+		history += "[" + std::to_string(g_adaptiveConcurrencyHistory[i].ticks) + "," + std::to_string(g_adaptiveConcurrencyHistory[i].limit) + "]";
+	}
+
+	history += "]";
+
+	std::string json = "{";
+	JsonAppendField(json, "mode", g_adaptiveConcurrencyEnabled ? "\"auto\"" : "\"fixed\"");
+	JsonAppendField(json, "workers", (unsigned long long)workers);
+	JsonAppendField(json, "limit", (unsigned long long)(g_adaptiveConcurrencyEnabled ? (size_t)g_adaptiveConcurrencyLimit : workers));
+	JsonAppendField(json, "in_flight", (unsigned long long)g_tasksInFlight);
+	JsonAppendField(json, "baseline_latency_ms", (unsigned long long)g_adaptiveConcurrencyBaselineLatency);
+	JsonAppendField(json, "history", history);
+	json += "}";
+
+	return json;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Cancellation
+///////////////////////////////////////////////////////////////////////
+
+// Requests carry a cancellation token named by the "cancel=<name>" option;
+// requests without one share the default token "". Cancelling a token closes
+// the request handles of its in-flight requests, which makes the blocking
+// WinINet call on the other thread fail straight away, and marks the token
+// so its queued requests are discarded instead of sent. The name then gets
+// a fresh token, so requests made afterwards are unaffected.
+struct cancel_token_t {
+	unsigned long long id;
+	tstring name;
+	std::atomic<bool> cancelled;
+	std::mutex mutex;
+	std::vector<HINTERNET> handles;
+};
+
+typedef std::shared_ptr<cancel_token_t> cancel_token_ptr_t;
+
+static std::map<tstring, cancel_token_ptr_t> g_cancelTokens;
+static std::mutex g_cancelTokensMutex;
+static unsigned long long g_cancelTokensNextId = 1;
+
+static cancel_token_ptr_t CancelTokenGet(const tstring& name)
+{
+	std::lock_guard<std::mutex> lock(g_cancelTokensMutex);
+
+	cancel_token_ptr_t& token = g_cancelTokens[name];
+
+	if (!token) {
+		token = std::make_shared<cancel_token_t>();
+		token->id = g_cancelTokensNextId++;
+		token->name = name;
+		token->cancelled = false;
+	}
+
+	return token;
+}
+
+// Returns false if the token was already cancelled, in which case the
+// caller still owns the handle.
+static bool CancelTokenAttach(cancel_token_t* token, HINTERNET handle)
+{
+	std::lock_guard<std::mutex> lock(token->mutex);
+
+	if (token->cancelled) {
+		return false;
+	}
+
+	token->handles.push_back(handle);
+
+	return true;
+}
+
+// Returns false if the handle has already been closed by a cancel
+static bool CancelTokenDetach(cancel_token_t* token, HINTERNET handle)
+{
+	std::lock_guard<std::mutex> lock(token->mutex);
+
+	auto it = std::find(token->handles.begin(), token->handles.end(), handle);
+
+	if (it == token->handles.end()) {
+		return false;
+	}
+
+	token->handles.erase(it);
+
+	return true;
+}
+
+static void CancelTokenCancel(cancel_token_t* token)
+{
+	std::lock_guard<std::mutex> lock(token->mutex);
+
+	token->cancelled = true;
+
+	for (size_t i = 0; i < token->handles.size(); ++i) {
+		InternetCloseHandle(token->handles[i]);
+	}
+
+	token->handles.clear();
+}
+
+// Cancels the token with the given name, or every token for "*"
+static void CancelRequests(const tstring& name)
+{
+	std::vector<cancel_token_ptr_t> tokens;
+
+	{
+		std::lock_guard<std::mutex> lock(g_cancelTokensMutex);
+
+		for (auto it = g_cancelTokens.begin(); it != g_cancelTokens.end();) {
+			if (name == TEXT("*") || it->first == name) {
+				tokens.push_back(it->second);
+				it = g_cancelTokens.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < tokens.size(); ++i) {
+		CancelTokenCancel(tokens[i].get());
+	}
+}
+
+// True if a spooled request's token has been cancelled since it was written
+static bool CancelTokenIsStale(const tstring& name, unsigned long long id)
+{
+	std::lock_guard<std::mutex> lock(g_cancelTokensMutex);
+
+	auto it = g_cancelTokens.find(name);
+
+	return it == g_cancelTokens.end() || it->second->id != id;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Progress
+///////////////////////////////////////////////////////////////////////
+
+// Async requests given an "id=<name>" option publish their progress for
+// HttpGetProgress. The transferring thread is the only writer: it bumps the
+// byte counters once per chunk with relaxed atomics and recomputes the
+// current rate at most every PROGRESS_RATE_INTERVAL_MILLISECONDS, so
+// publishing costs next to nothing against the transfer itself.
+enum progress_state_t {
+	PROGRESS_QUEUED,
+	PROGRESS_RUNNING,
+	PROGRESS_DONE,
+	PROGRESS_FAILED,
+	PROGRESS_DROPPED, // discarded by an overflow or circuit breaker policy without being sent
+};
+
+struct http_progress_t {
+	std::atomic<int> state;
+	std::atomic<unsigned long long> bytesSent;
+	std::atomic<unsigned long long> bytesReceived;
+	std::atomic<unsigned long long> sendTotal; // 0 if unknown
+	std::atomic<unsigned long long> receiveTotal; // 0 if unknown
+	std::atomic<ULONGLONG> startTicks;
+	std::atomic<ULONGLONG> endTicks;
+	std::atomic<ULONGLONG> rateTicks;
+	std::atomic<unsigned long long> rateBytes;
+	std::atomic<unsigned long long> rate; // bytes per second over the last interval
+	std::atomic<unsigned long long> phaseMicroseconds[HTTP_PHASE_COUNT];
+
+	// Fixed before the entry is published
+	ULONGLONG deadline;
+	cancel_token_ptr_t cancel;
+};
+
+typedef std::shared_ptr<http_progress_t> http_progress_ptr_t;
+
+static const ULONGLONG PROGRESS_RATE_INTERVAL_MILLISECONDS = 250;
+
+static std::map<tstring, http_progress_ptr_t> g_progress;
+static std::mutex g_progressMutex;
+
+// Publishes a fresh entry for id, replacing any earlier request's
+static http_progress_ptr_t ProgressCreate(const tstring& id, ULONGLONG deadline, const cancel_token_ptr_t& cancel)
+{
+	http_progress_ptr_t progress = std::make_shared<http_progress_t>();
+	progress->state = PROGRESS_QUEUED;
+	progress->bytesSent = 0;
+	progress->bytesReceived = 0;
+	progress->sendTotal = 0;
+	progress->receiveTotal = 0;
+	progress->startTicks = 0;
+	progress->endTicks = 0;
+	progress->rateTicks = 0;
+	progress->rateBytes = 0;
+	progress->rate = 0;
+
+	for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+		progress->phaseMicroseconds[phase] = 0;
+	}
+
+	progress->deadline = deadline;
+	progress->cancel = cancel;
+
+	std::lock_guard<std::mutex> lock(g_progressMutex);
+
+	g_progress[id] = progress;
+
+	return progress;
+}
+
+static http_progress_ptr_t ProgressFind(const tstring& id)
+{
+	std::lock_guard<std::mutex> lock(g_progressMutex);
+
+	auto it = g_progress.find(id);
+
+	return it != g_progress.end() ? it->second : http_progress_ptr_t();
+}
+
+static void ProgressStart(http_progress_t* progress)
+{
+	ULONGLONG now = GetTickCount64();
+
+	progress->startTicks = now;
+	progress->rateTicks = now;
+	progress->state = PROGRESS_RUNNING;
+}
+
+static void ProgressFinish(http_progress_t* progress, bool success)
+{
+	progress->endTicks = GetTickCount64();
+	progress->state = success ? PROGRESS_DONE : PROGRESS_FAILED;
+}
+
+static void ProgressDrop(http_progress_t* progress)
+{
+	progress->endTicks = GetTickCount64();
+	progress->state = PROGRESS_DROPPED;
+}
+
+static void ProgressAdd(http_progress_t* progress, std::atomic<unsigned long long>& counter, unsigned long long bytes)
+{
+	counter.fetch_add(bytes, std::memory_order_relaxed);
+
+	ULONGLONG now = GetTickCount64();
+	ULONGLONG elapsed = now - progress->rateTicks.load(std::memory_order_relaxed);
+
+	if (elapsed >= PROGRESS_RATE_INTERVAL_MILLISECONDS) {
+		unsigned long long total = progress->bytesSent.load(std::memory_order_relaxed) + progress->bytesReceived.load(std::memory_order_relaxed);
+
+		progress->rate.store((total - progress->rateBytes.load(std::memory_order_relaxed)) * 1000 / elapsed, std::memory_order_relaxed);
+		progress->rateBytes.store(total, std::memory_order_relaxed);
+		progress->rateTicks.store(now, std::memory_order_relaxed);
+	}
+}
+
+static std::string ProgressToJson(const http_progress_t& progress)
+{
+	static const char* STATES[] = { "queued", "running", "done", "failed", "dropped" };
+
+	int state = progress.state;
+	const char* stateName = STATES[state];
+
+	if ((state == PROGRESS_QUEUED || state == PROGRESS_FAILED) && progress.cancel && progress.cancel->cancelled) {
+		// Discarded from the queue, or cut off by the cancel mid-transfer
+		stateName = "cancelled";
+	}
+	else if (state == PROGRESS_QUEUED && progress.deadline && GetTickCount64() >= progress.deadline) {
+		stateName = "expired";
+	}
+
+	unsigned long long sent = progress.bytesSent;
+	unsigned long long received = progress.bytesReceived;
+	unsigned long long averageRate = 0;
+
+	if (state != PROGRESS_QUEUED && state != PROGRESS_DROPPED) {
+		ULONGLONG end = state == PROGRESS_RUNNING ? GetTickCount64() : (ULONGLONG)progress.endTicks;
+		ULONGLONG elapsed = end - progress.startTicks;
+
+		averageRate = elapsed ? (sent + received) * 1000 / elapsed : 0;
+	}
+
+	std::string json = "{";
+	JsonAppendField(json, "state", std::string("\"") + stateName + "\"");
+	JsonAppendField(json, "sent", sent);
+	JsonAppendField(json, "send_total", StatsGet(progress.sendTotal));
+	JsonAppendField(json, "received", received);
+	JsonAppendField(json, "receive_total", StatsGet(progress.receiveTotal));
+	JsonAppendField(json, "rate", state == PROGRESS_RUNNING ? StatsGet(progress.rate) : 0ULL);
+	JsonAppendField(json, "average_rate", averageRate);
+
+	std::string timing = "{";
+
+	for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+		JsonAppendField(timing, HTTP_PHASE_NAMES[phase], StatsGet(progress.phaseMicroseconds[phase]));
+	}
+
+	timing += "}";
+
+	JsonAppendField(json, "timing_us", timing);
+	json += "}";
+
+	return json;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Bandwidth
+///////////////////////////////////////////////////////////////////////
+
+// Transfers are throttled by token buckets charged per chunk read or
+// written: a global one, an optional per-request one ("rate=<bytes/s>"),
+// and one that background requests go through only while critical or
+// normal transfers are running, so they yield to foreground traffic. A
+// chunk may overdraw a bucket; the transfer then sleeps until the debt is
+// paid off, waiting on the slowest bucket it was charged to. Without a
+// background rate of its own, background traffic gets a share of the global
+// cap; with neither there is nothing to yield and it runs unthrottled.
+struct token_bucket_t {
+	std::atomic<unsigned long long> rate; // bytes per second, 0 for unlimited
+	unsigned long long burst;
+	double tokens;
+	ULONGLONG lastTicks;
+	std::mutex mutex;
+
+	token_bucket_t() : rate(0), burst(0), tokens(0), lastTicks(0) {}
+};
+
+// Per-request transfer state passed down to HttpRequest
+struct http_transfer_t {
+	http_progress_t* progress; // may be NULL
+	token_bucket_t* bucket; // per-request limit, may be NULL
+	bool background; // yields to foreground transfers
+	int status; // set by HttpRequest to the response status, 0 if none
+	bool throttled; // set by HttpRequest on a 429, or a 503 with Retry-After
+	unsigned long long traceId; // names the request in trace events, 0 for a new id
+};
+
+static const ULONGLONG BANDWIDTH_SLEEP_SLICE_MILLISECONDS = 100;
+// Background cap, as a share of the global one, when none is given
+static const unsigned long long BANDWIDTH_DEFAULT_BACKGROUND_PERCENT = 10;
+
+static token_bucket_t g_bandwidthGlobal;
+static token_bucket_t g_bandwidthBackground;
+static std::atomic<size_t> g_foregroundTransfers(0);
+
+// Burst defaults to one second's worth. Can be changed while transfers run.
+static void TokenBucketSet(token_bucket_t& bucket, unsigned long long rate, unsigned long long burst)
+{
+	std::lock_guard<std::mutex> lock(bucket.mutex);
+
+	bucket.burst = burst ? burst : rate;
+	bucket.tokens = (double)bucket.burst;
+	bucket.lastTicks = GetTickCount64();
+	bucket.rate = rate;
+}
+
+// Charges bytes to the bucket and returns how long to wait before sending more
+static ULONGLONG TokenBucketTake(token_bucket_t& bucket, size_t bytes)
+{
+	if (!bucket.rate) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(bucket.mutex);
+
+	unsigned long long rate = bucket.rate;
+
+	if (!rate) {
+		return 0;
+	}
+
+	ULONGLONG now = GetTickCount64();
+
+	bucket.tokens += (double)(now - bucket.lastTicks) * rate / 1000;
+	bucket.lastTicks = now;
+
+	if (bucket.tokens > (double)bucket.burst) {
+		bucket.tokens = (double)bucket.burst;
+	}
+
+	bucket.tokens -= (double)bytes;
+
+	return bucket.tokens < 0 ? (ULONGLONG)(-bucket.tokens * 1000 / rate) : 0;
+}
+
+static bool BandwidthLimited(const http_transfer_t* transfer)
+{
+	return g_bandwidthGlobal.rate ||
+		(transfer && ((transfer->bucket && transfer->bucket->rate) || (transfer->background && g_bandwidthBackground.rate)));
+}
+
+static void BandwidthThrottle(const http_transfer_t* transfer, const cancel_token_t* cancel, size_t bytes)
+{
+	ULONGLONG wait = TokenBucketTake(g_bandwidthGlobal, bytes);
+
+	if (transfer && transfer->bucket) {
+		ULONGLONG requestWait = TokenBucketTake(*transfer->bucket, bytes);
+
+		if (requestWait > wait) {
+			wait = requestWait;
+		}
+	}
+
+	if (transfer && transfer->background && g_foregroundTransfers) {
+		ULONGLONG backgroundWait = TokenBucketTake(g_bandwidthBackground, bytes);
+
+		if (backgroundWait > wait) {
+			wait = backgroundWait;
+		}
+	}
+
+	// Sleep in slices so a cancel doesn't have to wait for the debt
+	while (wait && !(cancel && cancel->cancelled)) {
+		ULONGLONG slice = wait < BANDWIDTH_SLEEP_SLICE_MILLISECONDS ? wait : BANDWIDTH_SLEEP_SLICE_MILLISECONDS;
+
+		Sleep((DWORD)slice);
+		wait -= slice;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Queue
+///////////////////////////////////////////////////////////////////////
+
+// Description of a queued request, kept alongside the task so it can be
+// written to the spool when the queue overflows.
+struct queued_request_t {
+	int priority;
+	ULONGLONG deadline; // GetTickCount64() value after which it's dropped, 0 for none
+	cancel_token_ptr_t cancel;
+	tstring id; // names the request for HttpGetProgress, empty for none
+	http_progress_ptr_t progress;
+	unsigned long long rateLimit; // bytes per second, 0 for unlimited
+	int attempts; // earlier tries rejected with 429; not spooled
+	LONGLONG queuedCounter; // TimingNow() when queued, 0 if unknown; not spooled
+	tstring verb;
+	tstring url;
+	tstring headers;
+	std::string content;
+};
+
+enum queue_overflow_policy_t {
+	QUEUE_OVERFLOW_BLOCK,
+	QUEUE_OVERFLOW_DROP_OLDEST,
+	QUEUE_OVERFLOW_DROP_NEWEST,
+	QUEUE_OVERFLOW_SPILL,
+};
+
+// Async requests are queued in one lock-free sub-queue per priority class
+// and dequeued by weight, so critical work gets most worker picks but
+// background work still makes progress under saturation.
+enum task_priority_t {
+	TASK_PRIORITY_CRITICAL,
+	TASK_PRIORITY_NORMAL,
+	TASK_PRIORITY_BACKGROUND,
+	TASK_PRIORITY_COUNT
+};
+
+static const unsigned int TASK_PRIORITY_WEIGHTS[TASK_PRIORITY_COUNT] = { 8, 3, 1 };
+static const unsigned int TASK_PRIORITY_TOTAL_WEIGHT = 8 + 3 + 1;
+
+enum enqueue_result_t {
+	ENQUEUE_OK,
+	ENQUEUE_DROPPED_OLDEST,
+	ENQUEUE_SPILLED,
+	ENQUEUE_REJECTED,
+};
+
+// Move-only replacement for std::function<void()> with inline storage sized
+// for the closures we queue (a captured queued_request_t), so queueing a task
+// doesn't allocate for the closure and moving it through the queue never
+// copies the captured request. Larger closures fall back to the heap.
+class task_function_t {
+public:
+	static const size_t INLINE_SIZE = 256;
+
+	task_function_t() : m_invoke(NULL), m_manage(NULL) {}
+	task_function_t(std::nullptr_t) : m_invoke(NULL), m_manage(NULL) {}
+
+	template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task_function_t>::value>::type>
+	task_function_t(F&& f) : m_invoke(NULL), m_manage(NULL)
+	{
+		typedef typename std::decay<F>::type callable_t;
+		typedef std::integral_constant<bool,
+			sizeof(callable_t) <= INLINE_SIZE &&
+			alignof(callable_t) <= alignof(storage_t) &&
+			std::is_nothrow_move_constructible<callable_t>::value> fits_inline_t;
+
+		construct<callable_t>(std::forward<F>(f), fits_inline_t());
+	}
+
+	task_function_t(task_function_t&& other) : m_invoke(NULL), m_manage(NULL)
+	{
+		moveFrom(other);
+	}
+
+	task_function_t& operator=(task_function_t&& other)
+	{
+		if (this != &other) {
+			reset();
+			moveFrom(other);
+		}
+
+		return *this;
+	}
+
+	task_function_t& operator=(std::nullptr_t)
+	{
+		reset();
+
+		return *this;
+	}
+
+	task_function_t(const task_function_t&) = delete;
+	task_function_t& operator=(const task_function_t&) = delete;
+
+	~task_function_t()
+	{
+		reset();
+	}
+
+	void operator()()
+	{
+		m_invoke(&m_storage);
+	}
+
+	explicit operator bool() const
+	{
+		return m_invoke != NULL;
+	}
+
+private:
+	typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type storage_t;
+
+	enum manage_op_t {
+		MANAGE_MOVE,
+		MANAGE_DESTROY,
+	};
+
+	typedef void(*invoke_t)(void* storage);
+	typedef void(*manage_t)(manage_op_t op, void* storage, void* source);
+
+	template <typename F>
+	struct inline_ops_t {
+		static void invoke(void* storage)
+		{
+			(*reinterpret_cast<F*>(storage))();
+		}
+
+		static void manage(manage_op_t op, void* storage, void* source)
+		{
+			if (op == MANAGE_MOVE) {
+				new (storage) F(std::move(*reinterpret_cast<F*>(source)));
+				reinterpret_cast<F*>(source)->~F();
+			}
+			else {
+				reinterpret_cast<F*>(storage)->~F();
+			}
+		}
+	};
+
+	template <typename F>
+	struct heap_ops_t {
+		static void invoke(void* storage)
+		{
+			(**reinterpret_cast<F**>(storage))();
+		}
+
+		static void manage(manage_op_t op, void* storage, void* source)
+		{
+			if (op == MANAGE_MOVE) {
+				*reinterpret_cast<F**>(storage) = *reinterpret_cast<F**>(source);
+			}
+			else {
+				delete *reinterpret_cast<F**>(storage);
+			}
+		}
+	};
+
+	template <typename F, typename Arg>
+	void construct(Arg&& f, std::true_type)
+	{
+		new (&m_storage) F(std::forward<Arg>(f));
+		m_invoke = &inline_ops_t<F>::invoke;
+		m_manage = &inline_ops_t<F>::manage;
+	}
+
+	template <typename F, typename Arg>
+	void construct(Arg&& f, std::false_type);
+
+	void moveFrom(task_function_t& other)
+	{
+		if (other.m_manage) {
+			other.m_manage(MANAGE_MOVE, &m_storage, &other.m_storage);
+		}
+
+		m_invoke = other.m_invoke;
+		m_manage = other.m_manage;
+		other.m_invoke = NULL;
+		other.m_manage = NULL;
+	}
+
+	void reset()
+	{
+		if (m_manage) {
+			m_manage(MANAGE_DESTROY, &m_storage, NULL);
+		}
+
+		m_invoke = NULL;
+		m_manage = NULL;
+	}
+
+	storage_t m_storage;
+	invoke_t m_invoke;
+	manage_t m_manage;
+};
+
+template <typename F, typename Arg>
+void task_function_t::construct(Arg&& f, std::false_type)
+{
+	StatsIncrement(g_stats.taskHeapAllocations);
+
+	*reinterpret_cast<F**>(&m_storage) = new F(std::forward<Arg>(f));
+	m_invoke = &heap_ops_t<F>::invoke;
+	m_manage = &heap_ops_t<F>::manage;
+}
+
+typedef task_function_t taskQueueItem_t;
+
+// A queued unit of work plus what the scheduler needs to know about it
+struct task_t {
+	taskQueueItem_t run;
+	int priority;
+	tstring host; // lower-case host name, empty when not bound to a host
+	bool hostAdmitted; // counted against the host's in-flight limit
+	bool local; // spawned into a worker's own deque rather than the queue
+	ULONGLONG deadline; // see queued_request_t::deadline
+	cancel_token_ptr_t cancel;
+	http_progress_ptr_t progress; // published for the task, if any
+
+	task_t() : priority(TASK_PRIORITY_NORMAL), hostAdmitted(false), local(false), deadline(0) {}
+
+	task_t(taskQueueItem_t run, int priority = TASK_PRIORITY_NORMAL, const tstring& host = tstring(), ULONGLONG deadline = 0) :
+		run(std::move(run)), priority(priority), host(host), hostAdmitted(false), local(false), deadline(deadline)
+	{
+		if (this->priority < 0 || this->priority >= TASK_PRIORITY_COUNT) {
+			this->priority = TASK_PRIORITY_NORMAL;
+		}
+	}
+};
+
+// Earliest deadline first; tasks without a deadline (0, which wraps to the
+// largest value) sort after those with one.
+static bool TaskDeadlineBefore(const task_t& a, const task_t& b)
+{
+	return a.deadline - 1 < b.deadline - 1;
+}
+
+static moodycamel::ConcurrentQueue<task_t> g_TaskQueues[TASK_PRIORITY_COUNT];
+// Counts tasks across all sub-queues; workers block on it.
+static moodycamel::details::mpmc_sema::LightweightSemaphore g_taskQueueSema;
+static std::atomic<unsigned int> g_taskQueueDequeueTicket(0);
+static volatile bool g_taskConsumersKeepRunning = true;
+static volatile bool g_taskConsumersGracefulShutdown = true;
+static std::vector<std::thread> g_taskConsumers;
+static std::atomic<size_t> g_taskConsumersCount(0);
+
+// Upper bound for how many tasks a worker takes from the queue at once
+static const size_t TASK_BATCH_MAX = 8;
+
+// Producer and consumer tokens for the priority sub-queues. Tokens let the
+// queue skip looking up the calling thread's sub-queue on every operation;
+// each token set must only be used by one thread at a time.
+struct task_producer_t {
+	std::vector<moodycamel::ProducerToken> tokens;
+
+	task_producer_t()
+	{
+		tokens.reserve(TASK_PRIORITY_COUNT);
+
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			tokens.emplace_back(g_TaskQueues[priority]);
+		}
+	}
+};
+
+struct task_consumer_t {
+	std::vector<moodycamel::ConsumerToken> tokens;
+	task_producer_t producer; // for tasks a worker queues itself
+	std::deque<task_t> batch;
+
+	task_consumer_t()
+	{
+		tokens.reserve(TASK_PRIORITY_COUNT);
+
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			tokens.emplace_back(g_TaskQueues[priority]);
+		}
+	}
+};
+
+// Work stealing: every worker owns a deque for continuation-style subtasks
+// (e.g. the segments of a download) spawned by the task it is running. The
+// owner pops the newest subtask (LIFO, so a task's continuations run while
+// its connection is warm); idle workers steal the oldest (FIFO) from others.
+// A worker goes back to the shared queue after TASK_LOCAL_BURST local tasks
+// in a row, so short requests never wait behind a long chain of segments.
+struct task_worker_t {
+	std::mutex mutex;
+	std::deque<task_t> tasks;
+};
+
+static const size_t TASK_LOCAL_BURST = 4;
+
+static std::vector<std::unique_ptr<task_worker_t>> g_taskWorkers;
+static std::atomic<size_t> g_localTasksPending(0);
+static thread_local task_worker_t* g_currentTaskWorker = NULL;
+
+static bool TaskWorkerPopLocal(task_worker_t& worker, task_t& task)
+{
+	std::lock_guard<std::mutex> lock(worker.mutex);
+
+	if (worker.tasks.empty()) {
+		return false;
+	}
+
+	task = std::move(worker.tasks.back());
+	worker.tasks.pop_back();
+
+	return true;
+}
+
+static bool TaskWorkerSteal(size_t thiefIndex, task_t& task)
+{
+	if (!g_localTasksPending) {
+		return false;
+	}
+
+	for (size_t n = 1; n < g_taskWorkers.size(); ++n) {
+		task_worker_t& victim = *g_taskWorkers[(thiefIndex + n) % g_taskWorkers.size()];
+
+		std::lock_guard<std::mutex> lock(victim.mutex);
+
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+
+			StatsIncrement(g_stats.tasksStolen);
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Used for everything queued from NSIS script calls, which the installer
+// never makes concurrently.
+static task_producer_t* g_nsisTaskProducer = NULL;
+
+static task_producer_t* NsisTaskProducer()
+{
+	if (!g_nsisTaskProducer) {
+		g_nsisTaskProducer = new task_producer_t();
+	}
+
+	return g_nsisTaskProducer;
+}
+
+// 0 means unbounded
+size_t g_configTaskQueueCapacity = 0;
+queue_overflow_policy_t g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_BLOCK;
+unsigned long g_configTaskQueueBlockTimeoutMilliseconds = 1000;
+
+// Exact number of queued tasks; size_approx() is not good enough to
+// enforce a capacity.
+static std::atomic<size_t> g_taskQueueDepth(0);
+static std::atomic<size_t> g_taskQueueBlockedProducers(0);
+static std::mutex g_taskQueueSpaceMutex;
+static std::condition_variable g_taskQueueSpaceAvailable;
+
+static std::atomic<bool> g_spoolPending(false);
+static bool SpoolWrite(const queued_request_t& request);
+static void SpoolRefillTaskQueue(task_producer_t* producer);
+static void TelemetryFlushIfDue();
+
+// Queues a task that is already counted in g_taskQueueDepth
+static void TaskQueueRequeue(task_t task, task_producer_t* producer)
+{
+	int priority = task.priority;
+
+	if (producer) {
+		g_TaskQueues[priority].enqueue(producer->tokens[priority], std::move(task));
+	}
+	else {
+		g_TaskQueues[priority].enqueue(std::move(task));
+	}
+
+	g_taskQueueSema.signal();
+}
+
+static void TaskQueuePush(task_t task, task_producer_t* producer = NULL)
+{
+	StatsMax(g_stats.queueDepthHighWater, ++g_taskQueueDepth);
+
+	TaskQueueRequeue(std::move(task), producer);
+}
+
+// Waits up to `timeoutMicroseconds` for work and moves a batch of tasks into
+// the consumer's local batch. The batch size follows the queue depth per
+// worker, so a lightly loaded queue is still spread over all workers. The
+// priority class to take from first is picked by weight; the batch is then
+// ordered by priority and grouped by host so requests to the same host run
+// back to back on the same keep-alive connection.
+//
+// A batch is private to its worker, so anything behind the task it runs
+// waits for that task to finish. Critical tasks must not: when one is
+// queued the batch is a single task, and one that still ends up in a
+// larger batch is taken alone, the rest going back to the queue.
+static size_t TaskQueueDequeueBatch(task_consumer_t& consumer, std::int64_t timeoutMicroseconds)
+{
+	size_t workers = g_taskConsumersCount ? (size_t)g_taskConsumersCount : 1;
+	size_t batchSize = g_taskQueueDepth / workers;
+
+	if (batchSize < 1 || g_TaskQueues[TASK_PRIORITY_CRITICAL].size_approx()) {
+		batchSize = 1;
+	}
+	if (batchSize > TASK_BATCH_MAX) {
+		batchSize = TASK_BATCH_MAX;
+	}
+
+	auto count = g_taskQueueSema.waitMany(batchSize, timeoutMicroseconds);
+
+	if (count <= 0) {
+		return 0;
+	}
+
+	unsigned int slot = g_taskQueueDequeueTicket++ % TASK_PRIORITY_TOTAL_WEIGHT;
+	int preferred = 0;
+
+	while (slot >= TASK_PRIORITY_WEIGHTS[preferred]) {
+		slot -= TASK_PRIORITY_WEIGHTS[preferred];
+		++preferred;
+	}
+
+	// The semaphore guarantees `count` tasks are (or are about to be)
+	// visible across the sub-queues.
+	task_t buffer[TASK_BATCH_MAX];
+	size_t taken = 0;
+
+	while (taken < (size_t)count) {
+		taken += g_TaskQueues[preferred].try_dequeue_bulk(consumer.tokens[preferred], buffer + taken, count - taken);
+
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT && taken < (size_t)count; ++priority) {
+			if (priority != preferred) {
+				taken += g_TaskQueues[priority].try_dequeue_bulk(consumer.tokens[priority], buffer + taken, count - taken);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < taken; ++i) {
+		consumer.batch.push_back(std::move(buffer[i]));
+	}
+
+	std::stable_sort(consumer.batch.begin(), consumer.batch.end(), [](const task_t& a, const task_t& b) {
+		if (a.priority != b.priority) {
+			return a.priority < b.priority;
+		}
+
+		if (a.deadline != b.deadline) {
+			return TaskDeadlineBefore(a, b);
+		}
+
+		return a.host < b.host;
+	});
+
+	if (consumer.batch.size() > 1 && consumer.batch.front().priority == TASK_PRIORITY_CRITICAL) {
+		while (consumer.batch.size() > 1) {
+			TaskQueueRequeue(std::move(consumer.batch.back()), &consumer.producer);
+			consumer.batch.pop_back();
+		}
+
+		taken = 1;
+	}
+
+	return taken;
+}
+
+static bool TaskConsumerTakeBatched(task_consumer_t& consumer, task_t& task)
+{
+	if (consumer.batch.empty()) {
+		return false;
+	}
+
+	task = std::move(consumer.batch.front());
+	consumer.batch.pop_front();
+
+	return true;
+}
+
+// Picks the next task for a worker: its own deque, the shared queue, other
+// workers' deques, and finally a blocking wait on the shared queue.
+static bool TaskWorkerNext(size_t workerIndex, task_consumer_t& consumer, task_t& task, size_t& localBurst)
+{
+	task_worker_t& self = *g_taskWorkers[workerIndex];
+
+	if (localBurst < TASK_LOCAL_BURST && TaskWorkerPopLocal(self, task)) {
+		++localBurst;
+		return true;
+	}
+
+	localBurst = 0;
+
+	if (consumer.batch.empty()) {
+		TaskQueueDequeueBatch(consumer, 0);
+	}
+
+	if (TaskConsumerTakeBatched(consumer, task)) {
+		return true;
+	}
+
+	if (TaskWorkerPopLocal(self, task)) {
+		++localBurst;
+		return true;
+	}
+
+	if (TaskWorkerSteal(workerIndex, task)) {
+		return true;
+	}
+
+	// Poll quickly while other workers have stealable subtasks
+	TaskQueueDequeueBatch(consumer, g_localTasksPending ? 1000 : 100 * 1000);
+
+	return TaskConsumerTakeBatched(consumer, task);
+}
+
+// Hands a worker's unstarted batch back to the queue
+static void TaskQueueReturnBatch(task_consumer_t& consumer)
+{
+	while (!consumer.batch.empty()) {
+		TaskQueueRequeue(std::move(consumer.batch.front()), &consumer.producer);
+		consumer.batch.pop_front();
+	}
+}
+
+static int TaskQueueDequeueLowest(task_t& task)
+{
+	for (;;) {
+		for (int priority = TASK_PRIORITY_COUNT - 1; priority >= 0; --priority) {
+			if (g_TaskQueues[priority].try_dequeue(task)) {
+				return priority;
+			}
+		}
+	}
+}
+
+static void TaskQueueOnDequeue();
+
+static void TaskOnStart(const task_t& task)
+{
+	if (task.local) {
+		--g_localTasksPending;
+	}
+	else {
+		TaskQueueOnDequeue();
+	}
+}
+
+static bool TaskExpired(const task_t& task)
+{
+	return task.deadline && GetTickCount64() >= task.deadline;
+}
+
+static bool TaskCancelled(const task_t& task)
+{
+	return task.cancel && task.cancel->cancelled;
+}
+
+// Queued work that shouldn't be dispatched any more
+static bool TaskStale(const task_t& task)
+{
+	return TaskCancelled(task) || TaskExpired(task);
+}
+
+static void TaskQueueOnDequeue()
+{
+	--g_taskQueueDepth;
+
+	if (g_taskQueueBlockedProducers) {
+		// Take the lock so the wakeup can't slip in between a blocked
+		// producer's capacity check and its wait.
+		{
+			std::lock_guard<std::mutex> lock(g_taskQueueSpaceMutex);
+		}
+
+		g_taskQueueSpaceAvailable.notify_all();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Host scheduling
+///////////////////////////////////////////////////////////////////////
+
+// Optional per-host in-flight limits. A dequeued task whose host is at its
+// limit is parked in that host's pending queues instead of occupying a
+// worker; workers serve hosts with parked tasks round-robin before taking
+// new work, so a slow host holds at most its limit of workers and cannot
+// starve traffic to other hosts.
+struct host_schedule_t {
+	size_t inFlight;
+	std::deque<task_t> pending[TASK_PRIORITY_COUNT];
+
+	host_schedule_t() : inFlight(0) {}
+};
+
+// 0 means limited only by the number of workers
+size_t g_configDefaultHostConcurrencyLimit = 0;
+static std::map<tstring, size_t> g_configHostConcurrencyLimits;
+static std::atomic<bool> g_hostSchedulingEnabled(false);
+
+static std::map<tstring, host_schedule_t> g_hostSchedules;
+static std::vector<tstring> g_hostRoundRobin; // hosts with parked tasks
+static size_t g_hostRoundRobinCursor = 0;
+static std::atomic<size_t> g_hostParkedTasks(0);
+static std::mutex g_hostSchedulesMutex;
+
+// Callers hold g_hostSchedulesMutex
+static size_t HostConcurrencyLimit(const tstring& host)
+{
+	auto it = g_configHostConcurrencyLimits.find(host);
+
+	return it != g_configHostConcurrencyLimits.end() ? it->second : g_configDefaultHostConcurrencyLimit;
+}
+
+static bool HostHasPending(const host_schedule_t& schedule)
+{
+	for (int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+		if (!schedule.pending[priority].empty()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Optional per-host request-rate limits, set with HttpSetHostRateLimit, are
+// token buckets checked at the same point: a task whose host is out of
+// tokens is parked like one over the concurrency limit, and the round-robin
+// picks it up once the bucket has refilled, so no worker sleeps waiting for
+// a token. A 429, or a 503 with Retry-After, holds the host back for as long
+// as the server asked (1 s if it didn't say) and halves its rate, which then
+// recovers by a tenth of the configured rate per successful response.
+struct host_rate_t {
+	double configuredRate; // requests per second, 0 if only holding back after 429s
+	double rate;
+	double burst;
+	double tokens;
+	ULONGLONG refillTicks;
+	ULONGLONG holdUntilTicks;
+
+	host_rate_t() : configuredRate(0), rate(0), burst(0), tokens(0), refillTicks(0), holdUntilTicks(0) {}
+};
+
+// 429 Too Many Requests, which wininet.h has no name for
+static const DWORD HTTP_STATUS_RATE_LIMITED = 429;
+static const ULONGLONG HOST_RATE_DEFAULT_HOLD_MILLISECONDS = 1000;
+// Retry-After is capped so a flush at exit doesn't sit out a long one
+static const ULONGLONG HOST_RATE_MAX_HOLD_MILLISECONDS = 60 * 1000;
+static const double HOST_RATE_MIN = 0.1;
+// How often a request rejected with 429, or 503 with Retry-After, goes back in the queue
+static const int HOST_RATE_MAX_RETRIES = 3;
+
+static host_rate_t g_configDefaultHostRate; // configuredRate 0 when there's no default
+static std::map<tstring, host_rate_t> g_hostRates;
+
+// Callers hold g_hostSchedulesMutex
+static void HostSchedulingUpdateEnabled()
+{
+	g_hostSchedulingEnabled =
+		g_configDefaultHostConcurrencyLimit ||
+		!g_configHostConcurrencyLimits.empty() ||
+		g_configDefaultHostRate.configuredRate > 0 ||
+		!g_hostRates.empty();
+}
+
+// Callers hold g_hostSchedulesMutex. An entry without a configured rate is
+// erased by HostRateTryTake once its hold is over.
+static host_rate_t& HostRateGet(const tstring& host)
+{
+	auto it = g_hostRates.find(host);
+
+	if (it == g_hostRates.end()) {
+		host_rate_t& rate = g_hostRates[host];
+
+		rate = g_configDefaultHostRate;
+		rate.tokens = rate.burst;
+		rate.refillTicks = GetTickCount64();
+
+		return rate;
+	}
+
+	return it->second;
+}
+
+// Takes a token for a request to host. Callers hold g_hostSchedulesMutex.
+static bool HostRateTryTake(const tstring& host)
+{
+	if (g_configDefaultHostRate.configuredRate <= 0 && g_hostRates.find(host) == g_hostRates.end()) {
+		return true;
+	}
+
+	host_rate_t& rate = HostRateGet(host);
+	ULONGLONG now = GetTickCount64();
+
+	if (now < rate.holdUntilTicks) {
+		return false;
+	}
+
+	if (rate.configuredRate <= 0) {
+		// Only there to hold the host back after a 429, which is now over
+		g_hostRates.erase(host);
+		HostSchedulingUpdateEnabled();
+
+		return true;
+	}
+
+	rate.tokens += (double)(now - rate.refillTicks) * rate.rate / 1000;
+	rate.refillTicks = now;
+
+	if (rate.tokens > rate.burst) {
+		rate.tokens = rate.burst;
+	}
+
+	if (rate.tokens < 1) {
+		return false;
+	}
+
+	rate.tokens -= 1;
+
+	return true;
+}
+
+static void HostScheduleSetRate(const tstring& host, double requestsPerSecond, double burst)
+{
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	host_rate_t rate;
+	rate.configuredRate = requestsPerSecond;
+	rate.rate = requestsPerSecond;
+	rate.burst = burst >= 1 ? burst : (requestsPerSecond > 1 ? requestsPerSecond : 1);
+	rate.tokens = rate.burst;
+	rate.refillTicks = GetTickCount64();
+
+	if (host == TEXT("*")) {
+		g_configDefaultHostRate = requestsPerSecond > 0 ? rate : host_rate_t();
+	}
+	else if (requestsPerSecond > 0) {
+		g_hostRates[host] = rate;
+	}
+	else {
+		g_hostRates.erase(host);
+	}
+
+	HostSchedulingUpdateEnabled();
+}
+
+static std::time_t HttpParseDate(const tstring& value);
+
+// Milliseconds asked for by a Retry-After of seconds or an HTTP date, 0 if none
+static ULONGLONG HttpRetryAfterMilliseconds(const tstring& value)
+{
+	if (value.empty()) {
+		return 0;
+	}
+
+	if (_istdigit(value[0])) {
+		return _tcstoui64(value.c_str(), NULL, 10) * 1000;
+	}
+
+	std::time_t date = HttpParseDate(value);
+	std::time_t now = std::time(NULL);
+
+	return date > now ? (ULONGLONG)(date - now) * 1000 : 0;
+}
+
+// Feeds a response's status to the host's rate limiter and returns the status.
+// throttled is set if the server asked to be held back.
+static int HostRateObserveResponse(HINTERNET hRequest, const TCHAR* hostName, bool& throttled)
+{
+	DWORD status = 0;
+
+	throttled = false;
+
+	DWORD statusSize = sizeof(status);
+
+	if (!HttpQueryInfo(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &status, &statusSize, NULL)) {
+		return 0;
+	}
+
+	TCHAR retryAfter[64];
+	DWORD retryAfterSize = sizeof(retryAfter);
+	ULONGLONG holdMilliseconds = 0;
+
+	if ((status == HTTP_STATUS_RATE_LIMITED || status == HTTP_STATUS_SERVICE_UNAVAIL) &&
+		HttpQueryInfo(hRequest, HTTP_QUERY_RETRY_AFTER, retryAfter, &retryAfterSize, NULL)) {
+		holdMilliseconds = HttpRetryAfterMilliseconds(retryAfter);
+	}
+
+	throttled = status == HTTP_STATUS_RATE_LIMITED || holdMilliseconds;
+
+	// Without any limits there are no buckets to recover
+	if (!throttled && !g_hostSchedulingEnabled) {
+		return (int)status;
+	}
+
+	tstring host = hostName;
+
+	for (size_t i = 0; i < host.size(); ++i) {
+		host[i] = _totlower(host[i]);
+	}
+
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	if (!throttled) {
+		auto it = g_hostRates.find(host);
+
+		if (it != g_hostRates.end() && it->second.rate < it->second.configuredRate) {
+			host_rate_t& rate = it->second;
+
+			rate.rate += rate.configuredRate / 10;
+
+			if (rate.rate > rate.configuredRate) {
+				rate.rate = rate.configuredRate;
+			}
+		}
+
+		return (int)status;
+	}
+
+	StatsIncrement(g_stats.hostRateThrottled);
+
+	if (!holdMilliseconds) {
+		holdMilliseconds = HOST_RATE_DEFAULT_HOLD_MILLISECONDS;
+	}
+	else if (holdMilliseconds > HOST_RATE_MAX_HOLD_MILLISECONDS) {
+		holdMilliseconds = HOST_RATE_MAX_HOLD_MILLISECONDS;
+	}
+
+	host_rate_t& rate = HostRateGet(host);
+
+	rate.holdUntilTicks = GetTickCount64() + holdMilliseconds;
+
+	if (rate.rate > 0) {
+		rate.rate = rate.rate / 2 > HOST_RATE_MIN ? rate.rate / 2 : HOST_RATE_MIN;
+		// One request may go as soon as the hold is over
+		rate.tokens = 1;
+		rate.refillTicks = rate.holdUntilTicks;
+	}
+
+	HostSchedulingUpdateEnabled();
+
+	return (int)status;
+}
+
+// Returns true when the task may run now, false when it has been parked.
+static bool HostScheduleAdmit(task_t& task)
+{
+	if (!g_hostSchedulingEnabled || task.host.empty()) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	host_schedule_t& schedule = g_hostSchedules[task.host];
+	size_t limit = HostConcurrencyLimit(task.host);
+	bool hasPending = HostHasPending(schedule);
+
+	if ((!limit || schedule.inFlight < limit) && !hasPending && HostRateTryTake(task.host)) {
+		++schedule.inFlight;
+		task.hostAdmitted = true;
+
+		return true;
+	}
+
+	if (!hasPending) {
+		g_hostRoundRobin.push_back(task.host);
+	}
+
+	std::deque<task_t>& pending = schedule.pending[task.priority];
+	pending.insert(std::upper_bound(pending.begin(), pending.end(), task, TaskDeadlineBefore), std::move(task));
+	++g_hostParkedTasks;
+
+	return false;
+}
+
+static bool HostScheduleTakeParked(task_t& task)
+{
+	if (!g_hostParkedTasks) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	for (size_t n = 0; n < g_hostRoundRobin.size(); ++n) {
+		size_t index = (g_hostRoundRobinCursor + n) % g_hostRoundRobin.size();
+		const tstring& host = g_hostRoundRobin[index];
+		host_schedule_t& schedule = g_hostSchedules[host];
+		size_t limit = HostConcurrencyLimit(host);
+
+		if ((limit && schedule.inFlight >= limit) || !HostRateTryTake(host)) {
+			continue;
+		}
+
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			if (!schedule.pending[priority].empty()) {
+				task = std::move(schedule.pending[priority].front());
+				schedule.pending[priority].pop_front();
+				break;
+			}
+		}
+
+		++schedule.inFlight;
+		task.hostAdmitted = true;
+		--g_hostParkedTasks;
+
+		if (HostHasPending(schedule)) {
+			g_hostRoundRobinCursor = index + 1;
+		}
+		else {
+			g_hostRoundRobin.erase(g_hostRoundRobin.begin() + index);
+			g_hostRoundRobinCursor = index;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+static void HostScheduleRelease(const task_t& task)
+{
+	if (!task.hostAdmitted) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	auto it = g_hostSchedules.find(task.host);
+
+	if (it == g_hostSchedules.end()) {
+		return;
+	}
+
+	--it->second.inFlight;
+
+	if (!it->second.inFlight && !HostHasPending(it->second)) {
+		g_hostSchedules.erase(it);
+	}
+}
+
+static void HostScheduleSetLimit(const tstring& host, size_t limit)
+{
+	std::lock_guard<std::mutex> lock(g_hostSchedulesMutex);
+
+	if (host == TEXT("*")) {
+		g_configDefaultHostConcurrencyLimit = limit;
+	}
+	else if (limit) {
+		g_configHostConcurrencyLimits[host] = limit;
+	}
+	else {
+		g_configHostConcurrencyLimits.erase(host);
+	}
+
+	HostSchedulingUpdateEnabled();
+}
+
+static void TaskConsumersShutdown(bool graceful)
+{
+	g_taskConsumersGracefulShutdown = graceful;
+	g_taskConsumersKeepRunning = false;
+
+	for (int i = 0; i < g_taskConsumers.size(); ++i) {
+		if (g_taskConsumers[i].joinable()) {
+			g_taskConsumers[i].join();
+		}
+	}
+
+	g_taskConsumers.clear();
+	g_taskConsumersCount = 0;
+	g_taskWorkers.clear();
+}
+
+static void TaskConsumersInit(size_t numWorkers)
+{
+	TaskConsumersShutdown(false);
+
+	g_taskConsumersKeepRunning = true;
+	g_taskConsumersGracefulShutdown = true;
+
+	g_taskConsumersCount = numWorkers;
+
+	for (int i = 0; i < numWorkers; ++i) {
+		g_taskWorkers.emplace_back(new task_worker_t());
+	}
+
+	for (int i = 0; i < numWorkers; ++i) {
+		g_taskConsumers.emplace_back(std::thread([i]() {
+			task_consumer_t consumer;
+			task_t task;
+			size_t localBurst = 0;
+
+			g_currentTaskWorker = g_taskWorkers[i].get();
+
+			while (g_taskConsumersKeepRunning || ((g_taskQueueDepth || g_localTasksPending || g_spoolPending) && g_taskConsumersGracefulShutdown)) {
+				if (!AdaptiveConcurrencyWorkerAllowed(i)) {
+					TaskQueueReturnBatch(consumer);
+
+					std::this_thread::sleep_for(std::chrono::milliseconds(100));
+					continue;
+				}
+
+				bool haveTask = HostScheduleTakeParked(task);
+
+				if (!haveTask && TaskWorkerNext(i, consumer, task, localBurst)) {
+					haveTask = TaskStale(task) || HostScheduleAdmit(task);
+				}
+
+				if (haveTask && TaskStale(task)) {
+					// Stale by the time it came up; don't spend bandwidth on it
+					TaskOnStart(task);
+					StatsIncrement(TaskCancelled(task) ? g_stats.tasksCancelled : g_stats.tasksExpired);
+
+					HostScheduleRelease(task);
+					task = task_t();
+				}
+				else if (haveTask) {
+					TaskOnStart(task);
+					StatsIncrement(g_stats.queueDequeued[task.priority]);
+
+					++g_tasksInFlight;
+					task.run();
+					--g_tasksInFlight;
+
+					HostScheduleRelease(task);
+					task = task_t();
+				}
+
+				if (g_spoolPending) {
+					SpoolRefillTaskQueue(&consumer.producer);
+				}
+
+				TelemetryFlushIfDue();
+			}
+
+			TaskQueueReturnBatch(consumer);
+
+			// Subtasks nobody got to move to the shared queue
+			g_currentTaskWorker = NULL;
+
+			while (TaskWorkerPopLocal(*g_taskWorkers[i], task)) {
+				--g_localTasksPending;
+
+				task.local = false;
+				TaskQueuePush(std::move(task), &consumer.producer);
+			}
+		}));
+	}
+}
+
+// Applies the overflow policy when the queue is bounded and full. `request`
+// describes the task about to be queued for the spill policy; tasks without
+// one are rejected instead of spilled. The task may be pushed unless the
+// result is ENQUEUE_SPILLED or ENQUEUE_REJECTED.
+static enqueue_result_t TaskQueueMakeRoom(const queued_request_t* request)
+{
+	size_t capacity = g_configTaskQueueCapacity;
+	enqueue_result_t result = ENQUEUE_OK;
+
+	if (capacity && g_taskQueueDepth >= capacity) {
+		switch (g_configTaskQueueOverflowPolicy) {
+		case QUEUE_OVERFLOW_BLOCK:
+		{
+			std::unique_lock<std::mutex> lock(g_taskQueueSpaceMutex);
+
+			++g_taskQueueBlockedProducers;
+
+			bool hasSpace = g_taskQueueSpaceAvailable.wait_for(
+				lock,
+				std::chrono::milliseconds(g_configTaskQueueBlockTimeoutMilliseconds),
+				[capacity]() { return g_taskQueueDepth < capacity; });
+
+			--g_taskQueueBlockedProducers;
+
+			if (!hasSpace) {
+				StatsIncrement(g_stats.queueRejected);
+
+				return ENQUEUE_REJECTED;
+			}
+
+			break;
+		}
+
+		case QUEUE_OVERFLOW_DROP_OLDEST:
+		{
+			// Evict from the lowest priority class that has anything queued
+			task_t oldest;
+
+			if (g_taskQueueSema.tryWait()) {
+				TaskQueueDequeueLowest(oldest);
+				TaskQueueOnDequeue();
+				StatsIncrement(g_stats.queueDroppedOldest);
+
+				if (oldest.progress) {
+					ProgressDrop(oldest.progress.get());
+				}
+
+				result = ENQUEUE_DROPPED_OLDEST;
+			}
+
+			break;
+		}
+
+		case QUEUE_OVERFLOW_SPILL:
+			if (request && SpoolWrite(*request)) {
+				StatsIncrement(g_stats.queueSpilled);
+
+				return ENQUEUE_SPILLED;
+			}
+
+			// fall through
+
+		case QUEUE_OVERFLOW_DROP_NEWEST:
+			StatsIncrement(g_stats.queueRejected);
+
+			return ENQUEUE_REJECTED;
+		}
+	}
+
+	return result;
+}
+
+// Queues a continuation of the task currently running on this worker into
+// the worker's own deque. Outside a worker it is queued like any other task.
+static void SpawnLocalTask(task_t task)
+{
+	task_worker_t* worker = g_currentTaskWorker;
+
+	if (!worker) {
+		TaskQueuePush(std::move(task));
+		return;
+	}
+
+	task.local = true;
+
+	++g_localTasksPending;
+	StatsIncrement(g_stats.tasksSpawnedLocal);
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+
+	worker->tasks.push_back(std::move(task));
+}
+
+// Runs one subtask from the current worker's own deque, if it has any
+static bool TaskWorkerHelp()
+{
+	task_t task;
+
+	if (!g_currentTaskWorker || !TaskWorkerPopLocal(*g_currentTaskWorker, task)) {
+		return false;
+	}
+
+	TaskOnStart(task);
+	task.run();
+
+	return true;
+}
+
+// Runs the jobs in parallel and returns once all of them have. On a worker
+// they become local subtasks that idle workers can steal, and the caller
+// runs whatever hasn't been stolen itself; elsewhere each gets a thread.
+static void TaskRunParallel(std::vector<std::function<void()>>& jobs)
+{
+	if (jobs.empty()) {
+		return;
+	}
+
+	if (!g_currentTaskWorker) {
+		std::vector<std::thread> threads;
+
+		for (size_t i = 1; i < jobs.size(); ++i) {
+			threads.emplace_back(jobs[i]);
+		}
+
+		jobs[0]();
+
+		for (size_t i = 0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+
+		return;
+	}
+
+	struct join_t {
+		std::mutex mutex;
+		std::condition_variable finished;
+		size_t remaining;
+	};
+
+	std::shared_ptr<join_t> join = std::make_shared<join_t>();
+	join->remaining = jobs.size() - 1;
+
+	for (size_t i = 1; i < jobs.size(); ++i) {
+		std::function<void()>* job = &jobs[i];
+
+		SpawnLocalTask(task_t([join, job]() {
+			(*job)();
+
+			std::lock_guard<std::mutex> lock(join->mutex);
+
+			if (!--join->remaining) {
+				join->finished.notify_all();
+			}
+		}));
+	}
+
+	jobs[0]();
+
+	while (TaskWorkerHelp()) {
+	}
+
+	std::unique_lock<std::mutex> lock(join->mutex);
+
+	join->finished.wait(lock, [&]() { return !join->remaining; });
+}
+
+static enqueue_result_t EnqueueTask(task_t task, task_producer_t* producer = NULL)
+{
+	enqueue_result_t result = TaskQueueMakeRoom(NULL);
+
+	if (result == ENQUEUE_OK || result == ENQUEUE_DROPPED_OLDEST) {
+		TaskQueuePush(std::move(task), producer);
+	}
+
+	return result;
+}
+
+static const TCHAR* EnqueueResultToString(enqueue_result_t result)
+{
+	switch (result) {
+	case ENQUEUE_OK:
+		return TEXT("ok");
+	case ENQUEUE_DROPPED_OLDEST:
+		return TEXT("dropped-oldest");
+	case ENQUEUE_SPILLED:
+		return TEXT("spilled");
+	default:
+		return TEXT("queue-full");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// HTTP
+///////////////////////////////////////////////////////////////////////
+
+static const TCHAR* DEFAULT_USER_AGENT = TEXT("NSIS HTTP Client");
+
+unsigned long g_configConnectTimeoutMilliseconds = 5000;
+unsigned long g_configRequestTimeoutMilliseconds = 5000;
+unsigned long g_configResponseTimeoutMilliseconds = 5000;
+tstring g_userAgent = DEFAULT_USER_AGENT;
+unsigned long g_configPreconnectIdleTimeoutMilliseconds = 30000;
+
+///////////////////////////////////////////////////////////////////////
+// Session
+///////////////////////////////////////////////////////////////////////
+
+// WinINet pools keep-alive connections per session handle, so all requests
+// made with the default user agent share one session instead of opening a
+// new one (and a new TCP + TLS handshake) every time.
+static HINTERNET g_hInternetSession = NULL;
+static std::mutex g_hInternetSessionMutex;
+
+// Per-request state handed to WinINet as the handle context, so the status
+// callback can tell which request a notification belongs to.
+struct http_request_context_t {
+	bool connecting;
+	bool secure; // a TLS handshake follows each new connection
+	// TimingNow() at the start of each phase in progress, 0 when none is
+	LONGLONG phaseStarts[HTTP_PHASE_COUNT];
+	// Completed phases, summed over the retries and redirects of the request
+	http_timing_t timing;
+	// Name the request in trace events, 0 and NULL if tracing was off when it started
+	unsigned long long traceId;
+	const char* traceUrl;
+};
+
+static void HttpContextPhaseStart(http_request_context_t* context, http_phase_t phase, LONGLONG now)
+{
+	context->phaseStarts[phase] = now;
+}
+
+// Adds the phase in progress, if there is one, to the request's timing
+static void HttpContextPhaseEnd(http_request_context_t* context, http_phase_t phase, LONGLONG now)
+{
+	LONGLONG start = context->phaseStarts[phase];
+
+	if (!start) {
+		return;
+	}
+
+	context->phaseStarts[phase] = 0;
+
+	TimingSetPhase(context->timing, phase, start, now);
+
+	if (TraceEnabled()) {
+		TraceComplete(HTTP_PHASE_NAMES[phase], start, now, context->traceId, context->traceUrl);
+	}
+}
+
+// TLS session resumption is done by Schannel, whose client session cache is
+// process-wide and shared by every handle, so reconnects after an idle
+// timeout already get abbreviated handshakes. What we can observe is whether
+// a request had to open a new connection (and so handshake) at all.
+static void CALLBACK HttpStatusCallback(
+	HINTERNET hInternet,
+	DWORD_PTR dwContext,
+	DWORD dwInternetStatus,
+	LPVOID lpvStatusInformation,
+	DWORD dwStatusInformationLength)
+{
+	http_request_context_t* context = (http_request_context_t*)dwContext;
+
+	if (!context) {
+		return;
+	}
+
+	// Each start/end pair is added on its own, so retries and redirects
+	// within a request count what they spent in a phase and not the gaps
+	// between them
+	switch (dwInternetStatus) {
+	case INTERNET_STATUS_RESOLVING_NAME:
+		HttpContextPhaseStart(context, HTTP_PHASE_DNS, TimingNow());
+		break;
+	case INTERNET_STATUS_NAME_RESOLVED:
+		HttpContextPhaseEnd(context, HTTP_PHASE_DNS, TimingNow());
+		break;
+	case INTERNET_STATUS_CONNECTING_TO_SERVER:
+		context->connecting = true;
+
+		HttpContextPhaseStart(context, HTTP_PHASE_CONNECT, TimingNow());
+		break;
+	case INTERNET_STATUS_CONNECTED_TO_SERVER: {
+		LONGLONG now = TimingNow();
+
+		HttpContextPhaseEnd(context, HTTP_PHASE_CONNECT, now);
+
+		if (context->secure) {
+			HttpContextPhaseStart(context, HTTP_PHASE_TLS, now);
+		}
+		break;
+	}
+	case INTERNET_STATUS_SENDING_REQUEST: {
+		LONGLONG now = TimingNow();
+
+		HttpContextPhaseEnd(context, HTTP_PHASE_TLS, now);
+		HttpContextPhaseStart(context, HTTP_PHASE_SEND, now);
+		break;
+	}
+	case INTERNET_STATUS_REQUEST_SENT: {
+		LONGLONG now = TimingNow();
+
+		HttpContextPhaseEnd(context, HTTP_PHASE_SEND, now);
+		HttpContextPhaseStart(context, HTTP_PHASE_FIRST_BYTE, now);
+		break;
+	}
+	case INTERNET_STATUS_RESPONSE_RECEIVED:
+		// Also sent for every read of the body, when no phase is in progress
+		HttpContextPhaseEnd(context, HTTP_PHASE_FIRST_BYTE, TimingNow());
+		break;
+	}
+}
+
+static HINTERNET HttpSessionGet()
+{
+	std::lock_guard<std::mutex> lock(g_hInternetSessionMutex);
+
+	if (!g_hInternetSession) {
+		g_hInternetSession =
+			InternetOpen(
+				DEFAULT_USER_AGENT,
+				INTERNET_OPEN_TYPE_PRECONFIG,
+				NULL,
+				NULL,
+				0);
+
+		if (g_hInternetSession) {
+			InternetSetStatusCallback(g_hInternetSession, HttpStatusCallback);
+		}
+	}
+
+	return g_hInternetSession;
+}
+
+static void HttpSessionClose()
+{
+	std::lock_guard<std::mutex> lock(g_hInternetSessionMutex);
+
+	if (g_hInternetSession) {
+		InternetCloseHandle(g_hInternetSession);
+		g_hInternetSession = NULL;
+	}
+}
+
+static tstring HttpHostKey(const TCHAR* hostName, INTERNET_PORT port)
+{
+	tstring key = hostName;
+
+	for (size_t i = 0; i < key.size(); ++i) {
+		key[i] = _totlower(key[i]);
+	}
+
+	key += TEXT(":") + to_tstring(port);
+
+	return key;
+}
+
+static bool HttpUrlHost(const TCHAR* url, tstring& hostName, INTERNET_PORT& port)
+{
+	URL_COMPONENTS urlComponents;
+	memset(&urlComponents, 0, sizeof(urlComponents));
+	urlComponents.dwStructSize = sizeof(urlComponents);
+	urlComponents.dwHostNameLength = 1;
+
+	if (!url || !InternetCrackUrl(url, _tcsclen(url), 0, &urlComponents) || !urlComponents.dwHostNameLength) {
+		return false;
+	}
+
+	hostName.assign(urlComponents.lpszHostName, urlComponents.dwHostNameLength);
+
+	for (size_t i = 0; i < hostName.size(); ++i) {
+		hostName[i] = _totlower(hostName[i]);
+	}
+
+	port = urlComponents.nPort;
+
+	return true;
+}
+
+// HttpHostKey of the URL's host, or "" if it doesn't parse
+static tstring HttpUrlHostKey(const TCHAR* url)
+{
+	tstring hostName;
+	INTERNET_PORT port = 0;
+
+	return HttpUrlHost(url, hostName, port) ? HttpHostKey(hostName.c_str(), port) : tstring();
+}
+
+///////////////////////////////////////////////////////////////////////
+// Preconnect
+///////////////////////////////////////////////////////////////////////
+
+// Hosts warmed up by HttpPreconnect. The sockets themselves are parked in
+// the shared session's keep-alive pool; WinINet transparently re-dials a
+// pooled socket the server has closed, which serves as the health check.
+// We only track how many are believed to be parked and when they were last
+// used, so repeated HttpPreconnect calls skip hosts that are still warm.
+struct preconnect_entry_t {
+	size_t parked;
+	ULONGLONG lastUsedTicks;
+};
+
+static std::map<tstring, preconnect_entry_t> g_preconnectEntries;
+static std::mutex g_preconnectEntriesMutex;
+
+static bool PreconnectIsWarm(const tstring& hostKey, size_t count)
+{
+	std::lock_guard<std::mutex> lock(g_preconnectEntriesMutex);
+
+	auto it = g_preconnectEntries.find(hostKey);
+
+	if (it == g_preconnectEntries.end()) {
+		return false;
+	}
+
+	if (GetTickCount64() - it->second.lastUsedTicks >= g_configPreconnectIdleTimeoutMilliseconds) {
+		g_preconnectEntries.erase(it);
+
+		return false;
+	}
+
+	return it->second.parked >= count;
+}
+
+static void PreconnectPark(const tstring& hostKey, size_t maxParked)
+{
+	std::lock_guard<std::mutex> lock(g_preconnectEntriesMutex);
+
+	preconnect_entry_t& entry = g_preconnectEntries[hostKey];
+
+	if (entry.parked < maxParked) {
+		++entry.parked;
+	}
+
+	entry.lastUsedTicks = GetTickCount64();
+}
+
+// Called after every request: a completed keep-alive request returns its
+// socket to the pool and restarts the idle timer, a failed one means the
+// parked connections to that host can no longer be trusted.
+static void PreconnectTouch(const tstring& hostKey, bool success)
+{
+	std::lock_guard<std::mutex> lock(g_preconnectEntriesMutex);
+
+	auto it = g_preconnectEntries.find(hostKey);
+
+	if (it == g_preconnectEntries.end()) {
+		return;
+	}
+
+	if (success) {
+		it->second.lastUsedTicks = GetTickCount64();
+	}
+	else {
+		g_preconnectEntries.erase(it);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Happy Eyeballs
+///////////////////////////////////////////////////////////////////////
+
+// RFC 8305 "Connection Attempt Delay"
+static const DWORD HAPPY_EYEBALLS_ATTEMPT_DELAY_MILLISECONDS = 250;
+// How long the winning address family of a host is remembered
+static const ULONGLONG HAPPY_EYEBALLS_CACHE_TTL_MILLISECONDS = 10 * 60 * 1000;
+// How long a host none of whose addresses answered is remembered as such
+static const ULONGLONG HAPPY_EYEBALLS_FAILURE_TTL_MILLISECONDS = 10 * 1000;
+
+// WinINet tries the resolved addresses of a host one after another and waits
+// the full connect timeout on each, so a host whose IPv6 route is blackholed
+// stalls every request for seconds. When enabled, we race both families
+// ourselves once per host and cap WinINet's connect timeout to a few times
+// the winner's connect time, so it gives up on the broken family quickly.
+// WinINet still connects by host name: the race costs one throwaway connect
+// per dual-stack host and cache period, which is why it's opt-in.
+struct happy_eyeballs_entry_t {
+	int family; // AF_UNSPEC when the host is not dual-stack
+	tstring address; // numeric address of the winning attempt
+	ULONGLONG connectMilliseconds;
+	ULONGLONG resolvedTicks;
+	bool unreachable; // no address answered within the connect timeout
+};
+
+static bool g_configHappyEyeballs = false;
+static std::map<tstring, happy_eyeballs_entry_t> g_happyEyeballsEntries;
+static std::mutex g_happyEyeballsEntriesMutex;
+
+static bool WinsockInit()
+{
+	static const bool initialized = []() -> bool {
+		WSADATA wsaData;
+
+		return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+	}();
+
+	return initialized;
+}
+
+// Starts a non-blocking connect to every resolved address, alternating address
+// families with the preferred one first, and staggers attempts by the
+// connection attempt delay until one succeeds. Losing attempts are cancelled
+// by closing their sockets; the winning socket is closed as well since only
+// the outcome is handed over to WinINet. A cancel is noticed between waits,
+// which are never longer than the connection attempt delay.
+static bool HappyEyeballsRace(const TCHAR* hostName, INTERNET_PORT port, int preferredFamily, const cancel_token_t* cancel, happy_eyeballs_entry_t& result)
+{
+	if (!WinsockInit()) {
+		return false;
+	}
+
+	ADDRINFOT hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	PADDRINFOT addresses = NULL;
+
+	if (GetAddrInfo(hostName, to_tstring(port).c_str(), &hints, &addresses) != 0) {
+		return false;
+	}
+
+	std::vector<PADDRINFOT> addressesV6;
+	std::vector<PADDRINFOT> addressesV4;
+
+	for (PADDRINFOT ai = addresses; ai; ai = ai->ai_next) {
+		if (ai->ai_family == AF_INET6) {
+			addressesV6.push_back(ai);
+		}
+		else if (ai->ai_family == AF_INET) {
+			addressesV4.push_back(ai);
+		}
+	}
+
+	if (addressesV6.empty() || addressesV4.empty()) {
+		// Single-stack host: WinINet has nothing to fall back to anyway
+		FreeAddrInfo(addresses);
+
+		result.family = AF_UNSPEC;
+		result.address.clear();
+		result.connectMilliseconds = 0;
+		result.unreachable = false;
+
+		return true;
+	}
+
+	std::vector<PADDRINFOT>& first = preferredFamily == AF_INET ? addressesV4 : addressesV6;
+	std::vector<PADDRINFOT>& second = preferredFamily == AF_INET ? addressesV6 : addressesV4;
+	std::vector<PADDRINFOT> ordered;
+
+	for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+		if (i < first.size()) {
+			ordered.push_back(first[i]);
+		}
+		if (i < second.size()) {
+			ordered.push_back(second[i]);
+		}
+	}
+
+	struct attempt_t {
+		SOCKET socket;
+		PADDRINFOT address;
+		ULONGLONG startTicks;
+	};
+
+	std::vector<attempt_t> pending;
+	PADDRINFOT winner = NULL;
+	ULONGLONG winnerMilliseconds = 0;
+	size_t next = 0;
+	ULONGLONG raceStartTicks = GetTickCount64();
+
+	while (!winner && (next < ordered.size() || !pending.empty())) {
+		if (cancel && cancel->cancelled) {
+			break;
+		}
+
+		if (next < ordered.size() && pending.size() < FD_SETSIZE) {
+			PADDRINFOT ai = ordered[next++];
+			SOCKET s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+			if (s != INVALID_SOCKET) {
+				unsigned long nonBlocking = 1;
+				ioctlsocket(s, FIONBIO, &nonBlocking);
+
+				if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0) {
+					closesocket(s);
+					winner = ai;
+					break;
+				}
+				else if (WSAGetLastError() == WSAEWOULDBLOCK) {
+					attempt_t attempt = { s, ai, GetTickCount64() };
+					pending.push_back(attempt);
+				}
+				else {
+					closesocket(s);
+				}
+			}
+		}
+
+		if (pending.empty()) {
+			continue;
+		}
+
+		ULONGLONG elapsed = GetTickCount64() - raceStartTicks;
+
+		if (elapsed >= g_configConnectTimeoutMilliseconds) {
+			break;
+		}
+
+		ULONGLONG waitMilliseconds = g_configConnectTimeoutMilliseconds - elapsed;
+
+		if (waitMilliseconds > HAPPY_EYEBALLS_ATTEMPT_DELAY_MILLISECONDS) {
+			waitMilliseconds = HAPPY_EYEBALLS_ATTEMPT_DELAY_MILLISECONDS;
+		}
+
+		fd_set writable;
+		fd_set failed;
+		FD_ZERO(&writable);
+		FD_ZERO(&failed);
+
+		for (size_t i = 0; i < pending.size(); ++i) {
+			FD_SET(pending[i].socket, &writable);
+			FD_SET(pending[i].socket, &failed);
+		}
+
+		timeval timeout;
+		timeout.tv_sec = (long)(waitMilliseconds / 1000);
+		timeout.tv_usec = (long)((waitMilliseconds % 1000) * 1000);
+
+		if (select(0, NULL, &writable, &failed, &timeout) <= 0) {
+			// Timed out: start the next attempt, if any, while the others
+			// keep going
+			continue;
+		}
+
+		for (size_t i = 0; i < pending.size();) {
+			if (!winner && FD_ISSET(pending[i].socket, &writable)) {
+				winner = pending[i].address;
+				winnerMilliseconds = GetTickCount64() - pending[i].startTicks;
+			}
+
+			if (FD_ISSET(pending[i].socket, &writable) || FD_ISSET(pending[i].socket, &failed)) {
+				closesocket(pending[i].socket);
+				pending.erase(pending.begin() + i);
+			}
+			else {
+				++i;
+			}
+		}
+	}
+
+	// Cancel the losers
+	for (size_t i = 0; i < pending.size(); ++i) {
+		closesocket(pending[i].socket);
+	}
+
+	if (winner) {
+		TCHAR address[NI_MAXHOST];
+
+		if (GetNameInfo(winner->ai_addr, (int)winner->ai_addrlen, address, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0) {
+			winner = NULL;
+		}
+		else {
+			result.family = winner->ai_family;
+			result.address = address;
+			result.connectMilliseconds = winnerMilliseconds;
+			result.unreachable = false;
+		}
+	}
+	else if (!cancel || !cancel->cancelled) {
+		// Every attempt failed or timed out: WinINet, connecting directly to
+		// the same addresses, would only wait out the timeout again
+		result.family = AF_UNSPEC;
+		result.address.clear();
+		result.connectMilliseconds = 0;
+		result.unreachable = true;
+	}
+
+	FreeAddrInfo(addresses);
+
+	return winner != NULL || result.unreachable;
+}
+
+static bool HappyEyeballsLookup(const tstring& hostKey, const TCHAR* hostName, INTERNET_PORT port, const cancel_token_t* cancel, happy_eyeballs_entry_t& entry)
+{
+	int preferredFamily = AF_INET6;
+
+	{
+		std::lock_guard<std::mutex> lock(g_happyEyeballsEntriesMutex);
+
+		auto it = g_happyEyeballsEntries.find(hostKey);
+
+		if (it != g_happyEyeballsEntries.end()) {
+			ULONGLONG ttl = it->second.unreachable ? HAPPY_EYEBALLS_FAILURE_TTL_MILLISECONDS : HAPPY_EYEBALLS_CACHE_TTL_MILLISECONDS;
+
+			if (GetTickCount64() - it->second.resolvedTicks < ttl) {
+				entry = it->second;
+
+				return true;
+			}
+
+			if (it->second.family != AF_UNSPEC) {
+				preferredFamily = it->second.family;
+			}
+		}
+	}
+
+	if (!HappyEyeballsRace(hostName, port, preferredFamily, cancel, entry)) {
+		return false;
+	}
+
+	entry.resolvedTicks = GetTickCount64();
+
+	std::lock_guard<std::mutex> lock(g_happyEyeballsEntriesMutex);
+
+	g_happyEyeballsEntries[hostKey] = entry;
+
+	return true;
+}
+
+// True when WinINet connects straight to servers. Behind a proxy, or with
+// proxy auto-configuration that may pick one, the race would measure routes
+// WinINet never takes.
+static bool HappyEyeballsDirectConnection()
+{
+	INTERNET_PER_CONN_OPTION option;
+	option.dwOption = INTERNET_PER_CONN_FLAGS;
+
+	INTERNET_PER_CONN_OPTION_LIST list;
+	list.dwSize = sizeof(list);
+	list.pszConnection = NULL;
+	list.dwOptionCount = 1;
+	list.dwOptionError = 0;
+	list.pOptions = &option;
+
+	DWORD size = sizeof(list);
+
+	if (!InternetQueryOption(NULL, INTERNET_OPTION_PER_CONNECTION_OPTION, &list, &size)) {
+		return false;
+	}
+
+	return (option.Value.dwValue & (PROXY_TYPE_PROXY | PROXY_TYPE_AUTO_PROXY_URL | PROXY_TYPE_AUTO_DETECT)) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Circuit breaker
+///////////////////////////////////////////////////////////////////////
+
+// Optional per-host circuit breakers, enabled with HttpSetCircuitBreaker.
+// Every queued request's outcome goes into a window of the host's most
+// recent ones; when the share of failures in it reaches the threshold the
+// breaker opens and queued requests to the host stop going out: they are
+// put in the spool or dropped, depending on the policy, instead of each
+// tying up a worker until the connect timeout. Wait calls, hedges, mirror
+// downloads and preconnects are not held back by a breaker, so they don't
+// count towards one either. Once the breaker has been open for its cool-off
+// period the next request is let through as a probe (half-open); it closes
+// the breaker if it succeeds and opens it again if it fails. Spooled requests
+// stay in the spool while their host's breaker is open, so the spool replay is
+// what keeps probing a host nothing new is being queued for.
+enum circuit_state_t {
+	CIRCUIT_CLOSED,
+	CIRCUIT_OPEN,
+	CIRCUIT_HALF_OPEN,
+};
+
+enum circuit_breaker_policy_t {
+	CIRCUIT_BREAKER_SPOOL,
+	CIRCUIT_BREAKER_DROP,
+};
+
+struct circuit_breaker_t {
+	circuit_state_t state;
+	std::deque<bool> outcomes; // oldest first, true for a failure
+	size_t failures;
+	ULONGLONG openedTicks;
+	ULONGLONG probeTicks; // when the half-open probe went out, 0 if none has
+
+	circuit_breaker_t() : state(CIRCUIT_CLOSED), failures(0), openedTicks(0), probeTicks(0) {}
+};
+
+// Don't trip on the first couple of requests of a host
+static const size_t CIRCUIT_BREAKER_MIN_SAMPLES = 5;
+
+static size_t g_configCircuitBreakerWindow = 0; // 0 when disabled
+static unsigned int g_configCircuitBreakerFailurePercent = 50;
+static ULONGLONG g_configCircuitBreakerOpenMilliseconds = 30 * 1000;
+static circuit_breaker_policy_t g_configCircuitBreakerPolicy = CIRCUIT_BREAKER_SPOOL;
+
+static std::atomic<bool> g_circuitBreakerEnabled(false);
+static std::map<tstring, circuit_breaker_t> g_circuitBreakers;
+static std::mutex g_circuitBreakersMutex;
+
+// Whether a request to the host may go out now. Lets the half-open probe
+// through, and sets probe for it, so only call it for a request that will
+// be sent if allowed.
+static bool CircuitBreakerAllow(const tstring& hostKey, bool& probe)
+{
+	probe = false;
+
+	if (!g_circuitBreakerEnabled || hostKey.empty()) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+	auto it = g_circuitBreakers.find(hostKey);
+
+	if (it == g_circuitBreakers.end()) {
+		return true;
+	}
+
+	circuit_breaker_t& breaker = it->second;
+	ULONGLONG now = GetTickCount64();
+
+	switch (breaker.state) {
+	case CIRCUIT_OPEN:
+		if (now - breaker.openedTicks < g_configCircuitBreakerOpenMilliseconds) {
+			return false;
+		}
+
+		breaker.state = CIRCUIT_HALF_OPEN;
+		breaker.probeTicks = now;
+		probe = true;
+		return true;
+
+	case CIRCUIT_HALF_OPEN:
+		// A probe that never reported back (e.g. cancelled before it was
+		// sent) is replaced after another cool-off period.
+		if (breaker.probeTicks && now - breaker.probeTicks < g_configCircuitBreakerOpenMilliseconds) {
+			return false;
+		}
+
+		breaker.probeTicks = now;
+		probe = true;
+		return true;
+
+	default:
+		return true;
+	}
+}
+
+// Same answer as CircuitBreakerAllow without letting a probe through
+static bool CircuitBreakerBlocks(const tstring& hostKey)
+{
+	if (!g_circuitBreakerEnabled || hostKey.empty()) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+	auto it = g_circuitBreakers.find(hostKey);
+
+	if (it == g_circuitBreakers.end()) {
+		return false;
+	}
+
+	const circuit_breaker_t& breaker = it->second;
+	ULONGLONG now = GetTickCount64();
+
+	return (breaker.state == CIRCUIT_OPEN && now - breaker.openedTicks < g_configCircuitBreakerOpenMilliseconds) ||
+		(breaker.state == CIRCUIT_HALF_OPEN && breaker.probeTicks && now - breaker.probeTicks < g_configCircuitBreakerOpenMilliseconds);
+}
+
+// probe is what CircuitBreakerAllow set for the request
+static void CircuitBreakerRecord(const tstring& hostKey, bool success, bool probe)
+{
+	if (!g_circuitBreakerEnabled || hostKey.empty()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+	circuit_breaker_t& breaker = g_circuitBreakers[hostKey];
+	ULONGLONG now = GetTickCount64();
+
+	if (breaker.state == CIRCUIT_OPEN) {
+		// Requests that were already in flight when it opened
+		return;
+	}
+
+	if (breaker.state == CIRCUIT_HALF_OPEN) {
+		if (!probe) {
+			// Let through while the breaker was still closed: only the
+			// probe decides
+			return;
+		}
+
+		breaker.probeTicks = 0;
+
+		if (success) {
+			breaker.state = CIRCUIT_CLOSED;
+			breaker.outcomes.clear();
+			breaker.failures = 0;
+		}
+		else {
+			breaker.state = CIRCUIT_OPEN;
+			breaker.openedTicks = now;
+		}
+
+		return;
+	}
+
+	breaker.outcomes.push_back(!success);
+	breaker.failures += success ? 0 : 1;
+
+	while (breaker.outcomes.size() > g_configCircuitBreakerWindow) {
+		breaker.failures -= breaker.outcomes.front() ? 1 : 0;
+		breaker.outcomes.pop_front();
+	}
+
+	size_t minSamples = g_configCircuitBreakerWindow < CIRCUIT_BREAKER_MIN_SAMPLES ? g_configCircuitBreakerWindow : CIRCUIT_BREAKER_MIN_SAMPLES;
+
+	if (breaker.outcomes.size() >= minSamples &&
+		breaker.failures * 100 >= g_configCircuitBreakerFailurePercent * breaker.outcomes.size()) {
+		breaker.state = CIRCUIT_OPEN;
+		breaker.openedTicks = now;
+
+		StatsIncrement(g_stats.circuitBreakerTrips);
+	}
+}
+
+// Disposes of a queued request whose host's breaker is open. Spooling stops
+// once the workers are shutting down, as nobody would replay the spool.
+static void CircuitBreakerShortCircuit(const queued_request_t& request)
+{
+	if (g_configCircuitBreakerPolicy == CIRCUIT_BREAKER_SPOOL && g_taskConsumersKeepRunning && SpoolWrite(request)) {
+		StatsIncrement(g_stats.circuitBreakerSpooled);
+		return;
+	}
+
+	StatsIncrement(g_stats.circuitBreakerDropped);
+
+	if (request.progress) {
+		ProgressDrop(request.progress.get());
+	}
+}
+
+static void CircuitBreakerConfigure(size_t window, unsigned int failurePercent, ULONGLONG openMilliseconds, circuit_breaker_policy_t policy)
+{
+	std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+	g_configCircuitBreakerWindow = window;
+	g_configCircuitBreakerFailurePercent = failurePercent;
+	g_configCircuitBreakerOpenMilliseconds = openMilliseconds;
+	g_configCircuitBreakerPolicy = policy;
+
+	g_circuitBreakers.clear();
+	g_circuitBreakerEnabled = window > 0;
+}
+
+static std::string CircuitBreakersToJson()
+{
+	std::string hosts = "{";
+
+	{
+		std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+		for (auto it = g_circuitBreakers.begin(); it != g_circuitBreakers.end(); ++it) {
+			const char* state = it->second.state == CIRCUIT_OPEN ? "\"open\"" : it->second.state == CIRCUIT_HALF_OPEN ? "\"half-open\"" : "\"closed\"";
+
+			JsonAppendField(hosts, tchar_to_utf8(it->first.c_str()).c_str(), state);
+		}
+	}
+
+	hosts += "}";
+
+	std::string json = "{";
+	JsonAppendField(json, "enabled", g_circuitBreakerEnabled ? "true" : "false");
+	JsonAppendField(json, "trips", StatsGet(g_stats.circuitBreakerTrips));
+	JsonAppendField(json, "spooled", StatsGet(g_stats.circuitBreakerSpooled));
+	JsonAppendField(json, "dropped", StatsGet(g_stats.circuitBreakerDropped));
+	JsonAppendField(json, "hosts", hosts);
+	json += "}";
+
+	return json;
+}
+
+typedef std::function<bool(const TCHAR* headers, const void* buffer, size_t buffer_len)> http_response_callback_t;
+
+static const size_t HTTP_SEND_CHUNK_SIZE = 32768;
+
+// Sends the request. When progress is tracked or bandwidth is limited the
+// content is written in chunks, so the sent byte count moves during the
+// upload and each chunk can be throttled.
+static BOOL HttpSendRequestContent(
+	HINTERNET hRequest,
+	const TCHAR* request_headers_crlf,
+	const size_t request_headers_crlf_chars_len,
+	const void* request_content,
+	const size_t request_content_bytes_len,
+	const cancel_token_t* cancel,
+	http_transfer_t* transfer)
+{
+	http_progress_t* progress = transfer ? transfer->progress : NULL;
+
+	if ((!progress && !BandwidthLimited(transfer)) || !request_content_bytes_len) {
+		return HttpSendRequest(
+			hRequest,
+			request_headers_crlf,
+			request_headers_crlf_chars_len,
+			(LPVOID)request_content,
+			request_content_bytes_len);
+	}
+
+	if (progress) {
+		progress->sendTotal = request_content_bytes_len;
+	}
+
+	INTERNET_BUFFERS buffers;
+	memset(&buffers, 0, sizeof(buffers));
+	buffers.dwStructSize = sizeof(buffers);
+	buffers.lpcszHeader = request_headers_crlf;
+	buffers.dwHeadersLength = (DWORD)request_headers_crlf_chars_len;
+	buffers.dwHeadersTotal = (DWORD)request_headers_crlf_chars_len;
+	buffers.dwBufferTotal = (DWORD)request_content_bytes_len;
+
+	if (!HttpSendRequestEx(hRequest, &buffers, NULL, 0, 0)) {
+		return FALSE;
+	}
+
+	const char* content = (const char*)request_content;
+
+	for (size_t offset = 0; offset < request_content_bytes_len;) {
+		size_t remaining = request_content_bytes_len - offset;
+		DWORD chunk = (DWORD)(remaining < HTTP_SEND_CHUNK_SIZE ? remaining : HTTP_SEND_CHUNK_SIZE);
+		DWORD written = 0;
+
+		if (!InternetWriteFile(hRequest, content + offset, chunk, &written) || !written) {
+			return FALSE;
+		}
+
+		offset += written;
+
+		if (progress) {
+			ProgressAdd(progress, progress->bytesSent, written);
+		}
+
+		BandwidthThrottle(transfer, cancel, written);
+	}
+
+	return HttpEndRequest(hRequest, NULL, 0, 0);
+}
+
+static BOOL HttpRequest(
+	const TCHAR* verb,
+	const TCHAR* url,
+	const TCHAR* user_agent = NULL,
+	const TCHAR* request_headers_crlf = NULL,
+	const size_t request_headers_crlf_chars_len = 0,
+	const void* request_content = NULL,
+	const size_t request_content_bytes_len = 0,
+	http_response_callback_t responseCallback = NULL,
+	cancel_token_t* cancel = NULL,
+	http_transfer_t* transfer = NULL)
+{
+	HINTERNET hInternet = NULL;
+	HINTERNET hConnect = NULL;
+	HINTERNET hRequest = NULL;
+	BOOL bResult = FALSE;
+	bool sharedSession = !user_agent;
+	ULONGLONG startTicks = GetTickCount64();
+	tstring hostKey;
+	happy_eyeballs_entry_t route;
+	route.family = AF_UNSPEC;
+	route.unreachable = false;
+	http_request_context_t context;
+	memset(&context, 0, sizeof(context));
+	std::string traceUrl;
+	bool cancelAttached = false;
+	int status = 0;
+	bool throttled = false;
+	http_progress_t* progress = transfer ? transfer->progress : NULL;
+	LONGLONG responseHeadersReceived = 0;
+	LONGLONG requestStart = TimingNow();
+	LONGLONG transferEnd = 0;
+	unsigned long long bytesReceived = 0;
+
+	if (cancel && cancel->cancelled) {
+		return FALSE;
+	}
+
+	if (TraceEnabled()) {
+		traceUrl = tchar_to_utf8(url);
+		context.traceId = transfer && transfer->traceId ? transfer->traceId : TraceNewId();
+		context.traceUrl = traceUrl.c_str();
+	}
+	
+	unsigned long g_configMaxConnectionsPerServer = g_taskConsumers.size() ? g_taskConsumers.size() : 4;
+	BOOL g_configHttpDecoding = TRUE;
+
+	URL_COMPONENTS urlComponents;
+	memset(&urlComponents, 0, sizeof(urlComponents));
+	urlComponents.dwStructSize = sizeof(urlComponents);
+	urlComponents.dwSchemeLength = 64;
+	urlComponents.dwHostNameLength = 1024;
+	urlComponents.dwUserNameLength = 1024;
+	urlComponents.dwPasswordLength = 1024;
+	urlComponents.dwUrlPathLength = 32768;
+
+	urlComponents.lpszScheme = new TCHAR[urlComponents.dwSchemeLength];
+	urlComponents.lpszHostName = new TCHAR[urlComponents.dwHostNameLength];
+	urlComponents.lpszUserName = new TCHAR[urlComponents.dwUserNameLength];
+	urlComponents.lpszPassword = new TCHAR[urlComponents.dwPasswordLength];
+	urlComponents.lpszUrlPath = new TCHAR[urlComponents.dwUrlPathLength];
+
+	if (!InternetCrackUrl(url, _tcsclen(url), ICU_DECODE, &urlComponents)) {
+		goto failed_parse_url;
+	}
+
+	hostKey = HttpHostKey(urlComponents.lpszHostName, urlComponents.nPort);
+	context.secure = urlComponents.nScheme == INTERNET_SCHEME_HTTPS;
+
+	if (g_configHappyEyeballs && HappyEyeballsDirectConnection()) {
+		if (!HappyEyeballsLookup(hostKey, urlComponents.lpszHostName, urlComponents.nPort, cancel, route)) {
+			route.family = AF_UNSPEC;
+			route.unreachable = false;
+		}
+
+		if (route.unreachable || (cancel && cancel->cancelled)) {
+			goto failed_session_connect;
+		}
+	}
+
+	hInternet = sharedSession ?
+		HttpSessionGet() :
+		InternetOpen(
+			user_agent,
+			INTERNET_OPEN_TYPE_PRECONFIG,
+			NULL,
+			NULL,
+			0);
+
+	if (!hInternet) {
+		goto failed_internet_open;
+	}
+
+	if (!sharedSession) {
+		InternetSetStatusCallback(hInternet, HttpStatusCallback);
+	}
+
+	InternetSetOption(hInternet, INTERNET_OPTION_CONNECT_TIMEOUT, &g_configConnectTimeoutMilliseconds, sizeof(g_configConnectTimeoutMilliseconds));
+
+	InternetSetOption(hInternet, INTERNET_OPTION_SEND_TIMEOUT, &g_configRequestTimeoutMilliseconds, sizeof(g_configRequestTimeoutMilliseconds));
+	InternetSetOption(hInternet, INTERNET_OPTION_CONTROL_SEND_TIMEOUT, &g_configRequestTimeoutMilliseconds, sizeof(g_configRequestTimeoutMilliseconds));
+
+	InternetSetOption(hInternet, INTERNET_OPTION_RECEIVE_TIMEOUT, &g_configResponseTimeoutMilliseconds, sizeof(g_configResponseTimeoutMilliseconds));
+	InternetSetOption(hInternet, INTERNET_OPTION_CONTROL_RECEIVE_TIMEOUT, &g_configResponseTimeoutMilliseconds, sizeof(g_configResponseTimeoutMilliseconds));
+		
+	InternetSetOption(hInternet, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &g_configMaxConnectionsPerServer, sizeof(g_configMaxConnectionsPerServer));
+	InternetSetOption(hInternet, INTERNET_OPTION_IGNORE_OFFLINE, NULL, 0);
+
+	// https://docs.microsoft.com/en-us/windows/desktop/WinInet/content-encoding
+	InternetSetOption(hInternet, INTERNET_OPTION_HTTP_DECODING, &g_configHttpDecoding, sizeof(g_configHttpDecoding));
+
+	hConnect = InternetConnect(
+			hInternet,
+			urlComponents.lpszHostName,
+			urlComponents.nPort,
+			urlComponents.dwUserNameLength ? urlComponents.lpszUserName : NULL,
+			urlComponents.dwPasswordLength ? urlComponents.lpszPassword : NULL,
+			INTERNET_SERVICE_HTTP,
+			0,
+			(DWORD_PTR)&context);
+
+	if (!hConnect) {
+		goto failed_session_connect;
+	}
+
+	if (route.family != AF_UNSPEC) {
+		// Makes WinINet give up on the broken family quickly and move on
+		// to the working one
+		unsigned long connectTimeoutMilliseconds = (unsigned long)(route.connectMilliseconds * 4);
+
+		if (connectTimeoutMilliseconds < HAPPY_EYEBALLS_ATTEMPT_DELAY_MILLISECONDS * 4) {
+			connectTimeoutMilliseconds = HAPPY_EYEBALLS_ATTEMPT_DELAY_MILLISECONDS * 4;
+		}
+
+		if (connectTimeoutMilliseconds < g_configConnectTimeoutMilliseconds) {
+			InternetSetOption(hConnect, INTERNET_OPTION_CONNECT_TIMEOUT, &connectTimeoutMilliseconds, sizeof(connectTimeoutMilliseconds));
+		}
+	}
+
+	hRequest =
+		HttpOpenRequest(
+			hConnect,
+			verb,
+			urlComponents.lpszUrlPath,
+			NULL,
+			NULL,
+			NULL,
+			INTERNET_FLAG_NO_CACHE_WRITE |
+			INTERNET_FLAG_NO_COOKIES |
+			INTERNET_FLAG_NO_UI |
+			INTERNET_FLAG_PRAGMA_NOCACHE |
+			INTERNET_FLAG_RELOAD | (urlComponents.nScheme == INTERNET_SCHEME_HTTPS ? INTERNET_FLAG_SECURE : 0L),
+			(DWORD_PTR)&context);
+
+	if (!hRequest) {
+		goto failed_open_request;
+	}
+
+	if (cancel) {
+		cancelAttached = CancelTokenAttach(cancel, hRequest);
+
+		if (!cancelAttached) {
+			goto http_request_failed;
+		}
+	}
+
+	bResult =
+		HttpSendRequestContent(
+			hRequest,
+			request_headers_crlf,
+			request_headers_crlf_chars_len,
+			request_content,
+			request_content_bytes_len,
+			cancel,
+			transfer);
+
+	if (!bResult) {
+		goto http_request_failed;
+	}
+
+	responseHeadersReceived = TimingNow();
+
+	HttpContextPhaseEnd(&context, HTTP_PHASE_FIRST_BYTE, responseHeadersReceived);
+
+	status = HostRateObserveResponse(hRequest, urlComponents.lpszHostName, throttled);
+
+	if (transfer) {
+		transfer->status = status;
+		transfer->throttled = throttled;
+	}
+
+	if (urlComponents.nScheme == INTERNET_SCHEME_HTTPS) {
+		StatsIncrement(context.connecting ? g_stats.tlsHandshakes : g_stats.tlsConnectionsReused);
+	}
+
+	if (responseCallback || progress) {
+		if (progress) {
+			DWORD contentLength = 0;
+			DWORD contentLengthSize = sizeof(contentLength);
+
+			if (HttpQueryInfo(hRequest, HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER, &contentLength, &contentLengthSize, NULL)) {
+				progress->receiveTotal = contentLength;
+			}
+		}
+
+		DWORD headersBufSize = 0L;
+		HttpQueryInfo(hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &headersBufSize, NULL);
+		headersBufSize += sizeof(TCHAR);
+		TCHAR* headers = new TCHAR[headersBufSize / sizeof(TCHAR)];
+		
+		if (!HttpQueryInfo(hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, headers, &headersBufSize, NULL)) {
+			headers[0] = 0;
+		}
+
+		const size_t BUFFER_LEN = 32768;
+		char* buffer = new char[BUFFER_LEN];
+		
+		DWORD bytesRead = 0;
+		for (;;) {
+			if (!InternetReadFile(hRequest, buffer, BUFFER_LEN, &bytesRead)) {
+				// Dropped connection, timeout, or a cancel closing the handle:
+				// the response is incomplete
+				bResult = FALSE;
+				break;
+			}
+
+			bytesReceived += bytesRead;
+
+			if (progress) {
+				ProgressAdd(progress, progress->bytesReceived, bytesRead);
+			}
+
+			BandwidthThrottle(transfer, cancel, bytesRead);
+
+			if (responseCallback && !responseCallback(headers, buffer, bytesRead)) {
+				break;
+			}
+
+			// A short read doesn't mean the end of the response; 0 does
+			if (!bytesRead) {
+				break;
+			}
+		}
+
+		delete[] headers;
+		delete[] buffer;
+
+		if (cancel && cancel->cancelled) {
+			bResult = FALSE;
+		}
+
+		transferEnd = TimingNow();
+
+		TimingSetPhase(context.timing, HTTP_PHASE_TRANSFER, responseHeadersReceived, transferEnd);
+	}
+
+http_request_failed:
+	// A cancel closes the handle itself
+	if (!cancelAttached || CancelTokenDetach(cancel, hRequest)) {
+		InternetCloseHandle(hRequest);
+	}
+
+failed_open_request:
+	InternetCloseHandle(hConnect);
+
+failed_session_connect:
+	if (!sharedSession) {
+		InternetCloseHandle(hInternet);
+	}
+
+	PreconnectTouch(hostKey, bResult ? true : false);
+
+	TimingRecord(context.timing, progress ? progress->phaseMicroseconds : NULL);
+	HistogramRecordTiming(hostKey, context.timing, true, (unsigned long long)((TimingNow() - requestStart) * 1000000 / TimingFrequency()));
+
+	if (TraceEnabled()) {
+		// The other phases were traced as they ended
+		TraceComplete("request", requestStart, TimingNow(), context.traceId, context.traceUrl);
+		TraceComplete("transfer", responseHeadersReceived, transferEnd, context.traceId, context.traceUrl);
+	}
+
+	StatsIncrement(g_stats.requests);
+	StatsIncrement(g_stats.bytesReceived, bytesReceived);
+
+	if (bResult) {
+		StatsIncrement(g_stats.bytesSent, request_content_bytes_len);
+	}
+
+	if (!bResult && (!cancel || !cancel->cancelled)) {
+		StatsIncrement(g_stats.errorsTransport);
+	}
+	else if (status >= 500) {
+		StatsIncrement(g_stats.errorsServer);
+	}
+	else if (status >= 400) {
+		StatsIncrement(g_stats.errorsClient);
+	}
+
+	AdaptiveConcurrencyRecord(GetTickCount64() - startTicks, bResult ? true : false);
+
+failed_internet_open:
+failed_parse_url:
+	delete[] urlComponents.lpszScheme;
+	delete[] urlComponents.lpszHostName;
+	delete[] urlComponents.lpszUserName;
+	delete[] urlComponents.lpszPassword;
+	delete[] urlComponents.lpszUrlPath;
+
+	return bResult;
+}
+
+static task_t HttpRequestTask(queued_request_t request)
+{
+	tstring hostName;
+	INTERNET_PORT port = 0;
+
+	HttpUrlHost(request.url.c_str(), hostName, port);
+
+	int priority = request.priority;
+	ULONGLONG deadline = request.deadline;
+	cancel_token_ptr_t cancel = request.cancel;
+	http_progress_ptr_t progress = request.progress;
+
+	auto run = [request = std::move(request)]() {
+		tstring hostKey = HttpUrlHostKey(request.url.c_str());
+
+		bool probe = false;
+
+		if (!CircuitBreakerAllow(hostKey, probe)) {
+			CircuitBreakerShortCircuit(request);
+			return;
+		}
+
+		unsigned long long traceId = 0;
+
+		if (TraceEnabled()) {
+			traceId = TraceNewId();
+			TraceAsync("queued", request.queuedCounter, TimingNow(), traceId, tchar_to_utf8(request.url.c_str()).c_str());
+		}
+
+		if (request.queuedCounter) {
+			http_timing_t timing;
+			memset(&timing, 0, sizeof(timing));
+
+			TimingSetPhase(timing, HTTP_PHASE_QUEUE, request.queuedCounter, TimingNow());
+			TimingRecord(timing, request.progress ? request.progress->phaseMicroseconds : NULL);
+			HistogramRecordTiming(hostKey, timing, false, 0);
+		}
+
+		token_bucket_t bucket;
+		http_transfer_t transfer = { request.progress.get(), NULL, request.priority == TASK_PRIORITY_BACKGROUND, 0, false, traceId };
+
+		if (request.rateLimit) {
+			TokenBucketSet(bucket, request.rateLimit, 0);
+			transfer.bucket = &bucket;
+		}
+
+		if (!transfer.background) {
+			++g_foregroundTransfers;
+		}
+
+		if (request.progress) {
+			ProgressStart(request.progress.get());
+		}
+
+		BOOL bResult = HttpRequest(
+			request.verb.c_str(),
+			request.url.c_str(),
+			NULL, // user-agent
+			request.headers.c_str(),
+			request.headers.size(),
+			request.content.c_str(),
+			request.content.size(),
+			NULL,
+			request.cancel.get(),
+			&transfer);
+
+		if (!transfer.background) {
+			--g_foregroundTransfers;
+		}
+
+		if (!request.cancel || !request.cancel->cancelled) {
+			// A server error is as much a sign of a sick host as no response
+			CircuitBreakerRecord(hostKey, bResult && transfer.status < 500, probe);
+		}
+
+		if (transfer.throttled && request.attempts < HOST_RATE_MAX_RETRIES) {
+			// Parked by the host scheduler until the host's hold is over
+			queued_request_t retry = request;
+			++retry.attempts;
+			retry.queuedCounter = TimingNow();
+
+			StatsIncrement(g_stats.hostRateRetries);
+			TaskQueuePush(HttpRequestTask(std::move(retry)));
+			return;
+		}
+
+		if (request.progress) {
+			ProgressFinish(request.progress.get(), bResult ? true : false);
+		}
+	};
+
+	static_assert(sizeof(run) <= task_function_t::INLINE_SIZE, "request closure no longer fits task_function_t inline storage");
+
+	task_t task(std::move(run), priority, hostName, deadline);
+	task.cancel = std::move(cancel);
+	task.progress = std::move(progress);
+
+	return task;
+}
+
+static enqueue_result_t EnqueueRequest(queued_request_t request, task_producer_t* producer = NULL)
+{
+	// Published before a spill can write the request out, so the replay finds it
+	if (request.id.size()) {
+		request.progress = ProgressCreate(request.id, request.deadline, request.cancel);
+	}
+
+	request.queuedCounter = TimingNow();
+
+	enqueue_result_t result = TaskQueueMakeRoom(&request);
+
+	if (result == ENQUEUE_OK || result == ENQUEUE_DROPPED_OLDEST) {
+		TaskQueuePush(HttpRequestTask(std::move(request)), producer);
+	}
+	else if (result == ENQUEUE_REJECTED && request.progress) {
+		ProgressDrop(request.progress.get());
+	}
+
+	return result;
+}
+
+static int ParseRequestPriority(const TCHAR* value)
+{
+	if (!_tcsicmp(value, TEXT("critical"))) {
+		return TASK_PRIORITY_CRITICAL;
+	}
+	else if (!_tcsicmp(value, TEXT("background"))) {
+		return TASK_PRIORITY_BACKGROUND;
+	}
+	else {
+		return TASK_PRIORITY_NORMAL;
+	}
+}
+
+// Applies a "key=value;key=value" options string from the Ex API variants
+// to a queued request. Unknown keys are ignored.
+static void ParseRequestOptions(const TCHAR* options, queued_request_t& request)
+{
+	tstring str = options ? options : TEXT("");
+	size_t start = 0;
+
+	while (start < str.size()) {
+		size_t end = str.find(TEXT(';'), start);
+
+		if (end == tstring::npos) {
+			end = str.size();
+		}
+
+		tstring option = str.substr(start, end - start);
+		size_t equals = option.find(TEXT('='));
+
+		if (equals != tstring::npos) {
+			tstring key = option.substr(0, equals);
+			tstring value = option.substr(equals + 1);
+
+			if (!_tcsicmp(key.c_str(), TEXT("priority"))) {
+				request.priority = ParseRequestPriority(value.c_str());
+			}
+			else if (!_tcsicmp(key.c_str(), TEXT("ttl"))) {
+				// Milliseconds the request may wait in the queue before it's dropped
+				ULONGLONG ttl = _tcstoui64(value.c_str(), NULL, 10);
+
+				request.deadline = ttl ? GetTickCount64() + ttl : 0;
+			}
+			else if (!_tcsicmp(key.c_str(), TEXT("cancel"))) {
+				request.cancel = CancelTokenGet(value);
+			}
+			else if (!_tcsicmp(key.c_str(), TEXT("id"))) {
+				request.id = value;
+			}
+			else if (!_tcsicmp(key.c_str(), TEXT("rate"))) {
+				request.rateLimit = _tcstoui64(value.c_str(), NULL, 10);
+			}
+		}
+
+		start = end + 1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Spool
+///////////////////////////////////////////////////////////////////////
+
+// Requests that overflow a bounded queue under the spill policy are appended
+// to a temporary file as length-prefixed UTF-8 records, and fed back into the
+// queue by the workers once it has drained to half its capacity. The file is
+// deleted when it has been fully replayed. It only takes the overflow off
+// the heap: it is opened delete-on-close, so it goes away with the process
+// and whatever is still spooled when the process exits or crashes is lost.
+static HANDLE g_spoolFile = INVALID_HANDLE_VALUE;
+static LONGLONG g_spoolReadOffset = 0;
+static LONGLONG g_spoolWriteOffset = 0;
+static std::mutex g_spoolMutex;
+
+// A record the refill stepped over because its host's circuit breaker was
+// open. It stays in the file and is read again once the breaker lets
+// requests through; the file is kept until none are left.
+struct spool_deferred_t {
+	LONGLONG offset;
+	tstring hostKey;
+};
+
+static std::deque<spool_deferred_t> g_spoolDeferred; // in spool order
+
+static const size_t SPOOL_REFILL_BATCH_SIZE = 64;
+
+static void SpoolAppendField(std::string& buffer, const std::string& field)
+{
+	unsigned long length = (unsigned long)field.size();
+
+	buffer.append((const char*)&length, sizeof(length));
+	buffer.append(field);
+}
+
+static bool SpoolParseField(const std::string& buffer, size_t& offset, std::string& field)
+{
+	unsigned long length = 0;
+
+	if (offset + sizeof(length) > buffer.size()) {
+		return false;
+	}
+
+	memcpy(&length, buffer.data() + offset, sizeof(length));
+	offset += sizeof(length);
+
+	if (offset + length > buffer.size()) {
+		return false;
+	}
+
+	field.assign(buffer.data() + offset, length);
+	offset += length;
+
+	return true;
+}
+
+static void SpoolClose()
+{
+	if (g_spoolFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(g_spoolFile);
+		g_spoolFile = INVALID_HANDLE_VALUE;
+	}
+
+	g_spoolReadOffset = 0;
+	g_spoolWriteOffset = 0;
+	g_spoolDeferred.clear();
+	g_spoolPending = false;
+}
+
+static bool SpoolWrite(const queued_request_t& request)
+{
+	std::lock_guard<std::mutex> lock(g_spoolMutex);
+
+	if (g_spoolFile == INVALID_HANDLE_VALUE) {
+		TCHAR tempPath[MAX_PATH];
+
+		if (!GetTempPath(MAX_PATH, tempPath)) {
+			return false;
+		}
+
+		tstring spoolPath = tempPath;
+		spoolPath += TEXT("nsis-http-spool-") + to_tstring(GetCurrentProcessId()) + TEXT(".tmp");
+
+		g_spoolFile = CreateFile(
+			spoolPath.c_str(),
+			GENERIC_READ | GENERIC_WRITE,
+			0,
+			NULL,
+			CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+			NULL);
+
+		if (g_spoolFile == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+	}
+
+	std::string record;
+	SpoolAppendField(record, std::to_string(request.priority));
+	SpoolAppendField(record, std::to_string(request.deadline));
+	SpoolAppendField(record, request.cancel ? tchar_to_utf8(request.cancel->name.c_str()) : std::string());
+	SpoolAppendField(record, std::to_string(request.cancel ? request.cancel->id : 0));
+	SpoolAppendField(record, tchar_to_utf8(request.id.c_str()));
+	SpoolAppendField(record, std::to_string(request.rateLimit));
+	SpoolAppendField(record, tchar_to_utf8(request.verb.c_str()));
+	SpoolAppendField(record, tchar_to_utf8(request.url.c_str()));
+	SpoolAppendField(record, tchar_to_utf8(request.headers.c_str()));
+	SpoolAppendField(record, request.content);
+
+	std::string buffer;
+	SpoolAppendField(buffer, record);
+
+	LARGE_INTEGER offset;
+	offset.QuadPart = g_spoolWriteOffset;
+
+	DWORD bytesWritten = 0;
+
+	if (!SetFilePointerEx(g_spoolFile, offset, NULL, FILE_BEGIN) ||
+		!WriteFile(g_spoolFile, buffer.data(), (DWORD)buffer.size(), &bytesWritten, NULL) ||
+		bytesWritten != buffer.size()) {
+		return false;
+	}
+
+	g_spoolWriteOffset += buffer.size();
+	g_spoolPending = true;
+
+	return true;
+}
+
+// Reads the record at recordOffset and moves it past the record
+static bool SpoolRead(LONGLONG& recordOffset, queued_request_t& request)
+{
+	LARGE_INTEGER offset;
+	offset.QuadPart = recordOffset;
+
+	unsigned long length = 0;
+	DWORD bytesRead = 0;
+
+	if (!SetFilePointerEx(g_spoolFile, offset, NULL, FILE_BEGIN) ||
+		!ReadFile(g_spoolFile, &length, sizeof(length), &bytesRead, NULL) ||
+		bytesRead != sizeof(length)) {
+		return false;
+	}
+
+	std::string record(length, '\0');
+
+	if (length && (!ReadFile(g_spoolFile, &record[0], length, &bytesRead, NULL) || bytesRead != length)) {
+		return false;
+	}
+
+	recordOffset += sizeof(length) + length;
+
+	std::string priority, deadline, cancelName, cancelId, id, rateLimit, verb, url, headers;
+	size_t fieldOffset = 0;
+
+	if (!SpoolParseField(record, fieldOffset, priority) ||
+		!SpoolParseField(record, fieldOffset, deadline) ||
+		!SpoolParseField(record, fieldOffset, cancelName) ||
+		!SpoolParseField(record, fieldOffset, cancelId) ||
+		!SpoolParseField(record, fieldOffset, id) ||
+		!SpoolParseField(record, fieldOffset, rateLimit) ||
+		!SpoolParseField(record, fieldOffset, verb) ||
+		!SpoolParseField(record, fieldOffset, url) ||
+		!SpoolParseField(record, fieldOffset, headers) ||
+		!SpoolParseField(record, fieldOffset, request.content)) {
+		return false;
+	}
+
+	request.priority = atoi(priority.c_str());
+	request.deadline = strtoull(deadline.c_str(), NULL, 10);
+	request.id = utf8_to_tstring(id);
+	request.rateLimit = strtoull(rateLimit.c_str(), NULL, 10);
+	request.attempts = 0;
+	request.queuedCounter = 0;
+
+	if (request.id.size()) {
+		// Stays unset if a later request has taken over the id
+		http_progress_ptr_t progress = ProgressFind(request.id);
+
+		if (progress && progress->state == PROGRESS_QUEUED && progress->deadline == request.deadline) {
+			request.progress = progress;
+		}
+	}
+
+	unsigned long long tokenId = strtoull(cancelId.c_str(), NULL, 10);
+
+	if (tokenId) {
+		tstring name = utf8_to_tstring(cancelName);
+
+		// A cancelled token's name has moved on to a fresh token, so leave
+		// the request on the old one for the worker to discard.
+		if (CancelTokenIsStale(name, tokenId)) {
+			request.cancel = std::make_shared<cancel_token_t>();
+			request.cancel->id = tokenId;
+			request.cancel->name = name;
+			request.cancel->cancelled = true;
+		}
+		else {
+			request.cancel = CancelTokenGet(name);
+		}
+	}
+	request.verb = utf8_to_tstring(verb);
+	request.url = utf8_to_tstring(url);
+	request.headers = utf8_to_tstring(headers);
+
+	return true;
+}
+
+static void SpoolRefillTaskQueue(task_producer_t* producer)
+{
+	size_t capacity = g_configTaskQueueCapacity;
+	size_t lowWatermark = capacity ? capacity / 2 : SPOOL_REFILL_BATCH_SIZE;
+
+	if (g_taskQueueDepth > lowWatermark) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(g_spoolMutex, std::try_to_lock);
+
+	if (!lock.owns_lock() || g_spoolFile == INVALID_HANDLE_VALUE) {
+		// Another worker is already refilling
+		return;
+	}
+
+	// Breakers are only consulted once per host and refill
+	std::map<tstring, bool> blockedHosts;
+
+	auto blocked = [&](const tstring& hostKey) -> bool {
+		if (!g_taskConsumersKeepRunning) {
+			// Let everything through to be dropped by the breaker
+			return false;
+		}
+
+		auto it = blockedHosts.find(hostKey);
+
+		if (it == blockedHosts.end()) {
+			it = blockedHosts.insert(std::make_pair(hostKey, CircuitBreakerBlocks(hostKey))).first;
+		}
+
+		return it->second;
+	};
+
+	auto replay = [&](queued_request_t& request) {
+		if (request.deadline && GetTickCount64() >= request.deadline) {
+			StatsIncrement(g_stats.tasksExpired);
+			return;
+		}
+
+		TaskQueuePush(HttpRequestTask(std::move(request)), producer);
+	};
+
+	size_t replayed = 0;
+
+	for (auto it = g_spoolDeferred.begin(); it != g_spoolDeferred.end() && replayed < SPOOL_REFILL_BATCH_SIZE && g_taskQueueDepth <= lowWatermark;) {
+		if (blocked(it->hostKey)) {
+			++it;
+			continue;
+		}
+
+		queued_request_t request;
+		LONGLONG recordOffset = it->offset;
+
+		it = g_spoolDeferred.erase(it);
+
+		if (SpoolRead(recordOffset, request)) {
+			replay(request);
+			++replayed;
+		}
+	}
+
+	for (size_t i = 0; i < SPOOL_REFILL_BATCH_SIZE && replayed < SPOOL_REFILL_BATCH_SIZE && g_taskQueueDepth <= lowWatermark && g_spoolReadOffset < g_spoolWriteOffset; ++i) {
+		queued_request_t request;
+		LONGLONG recordOffset = g_spoolReadOffset;
+
+		if (!SpoolRead(g_spoolReadOffset, request)) {
+			// Unreadable spool: drop what's left rather than spin on it
+			g_spoolReadOffset = g_spoolWriteOffset;
+			break;
+		}
+
+		tstring hostKey = HttpUrlHostKey(request.url.c_str());
+
+		if (blocked(hostKey)) {
+			// Step over it: requests for other hosts spooled after it go ahead
+			spool_deferred_t deferred = { recordOffset, hostKey };
+			g_spoolDeferred.push_back(deferred);
+			continue;
+		}
+
+		replay(request);
+		++replayed;
+	}
+
+	if (g_spoolReadOffset >= g_spoolWriteOffset && g_spoolDeferred.empty()) {
+		SpoolClose();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////
+// Response cache
+///////////////////////////////////////////////////////////////////////
+
+// Opt-in cache for the GETs made by HttpGetStringWait, enabled with
+// HttpSetResponseCache. Responses are kept in an in-memory LRU and written
+// through to one file per URL in the cache directory; both are bounded in
+// bytes. A fresh entry (Cache-Control max-age or Expires) is served without
+// touching the network. A stale one is revalidated with If-None-Match /
+// If-Modified-Since and served from the cache on a 304.
+struct http_cache_entry_t {
+	tstring url;
+	tstring headers;
+	std::string body;
+	tstring etag;
+	tstring lastModified;
+	std::time_t freshUntil; // 0 if it always has to be revalidated
+};
+
+static std::atomic<bool> g_httpCacheEnabled(false);
+// HttpSetResponseCache may change these while requests run, so they are
+// only read under g_httpCacheMutex; HttpCacheConfig returns a copy
+static tstring g_configHttpCacheDirectory;
+static size_t g_configHttpCacheMemoryBytes = 0;
+static unsigned long long g_configHttpCacheDiskBytes = 0;
+
+static std::list<http_cache_entry_t> g_httpCacheLru; // most recently used first
+static std::map<tstring, std::list<http_cache_entry_t>::iterator> g_httpCacheIndex;
+static size_t g_httpCacheMemoryUsed = 0;
+static std::mutex g_httpCacheMutex;
+static std::mutex g_httpCacheDiskMutex;
+
+static bool FileReadAll(const tstring& path, std::string& data)
+{
+	HANDLE file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	DWORD bytesRead = 0;
+	bool result = GetFileSizeEx(file, &size) && size.QuadPart < 0x7fffffff;
+
+	if (result) {
+		data.resize((size_t)size.QuadPart);
+		result = data.empty() || (ReadFile(file, &data[0], (DWORD)data.size(), &bytesRead, NULL) && bytesRead == data.size());
+	}
+
+	CloseHandle(file);
+
+	return result;
+}
+
+// Writes to a temporary file next to path and renames it into place, so
+// readers never see a partial file.
+static bool FileWriteAtomic(const tstring& path, const std::string& data)
+{
+	tstring tempPath = path + TEXT(".") + to_tstring(GetCurrentProcessId()) + TEXT(".") + to_tstring(GetCurrentThreadId()) + TEXT(".tmp");
+
+	HANDLE file = CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	DWORD bytesWritten = 0;
+	bool result = data.empty() || (WriteFile(file, data.data(), (DWORD)data.size(), &bytesWritten, NULL) && bytesWritten == data.size());
+
+	CloseHandle(file);
+
+	if (!result || !MoveFileEx(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFile(tempPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Deletes the least recently written files matching pattern until those
+// left fit in maxBytes. Files another process has open are skipped.
+static void DirectoryEvictLru(const tstring& directory, const TCHAR* pattern, unsigned long long maxBytes)
+{
+	struct file_t {
+		tstring path;
+		unsigned long long size;
+		unsigned long long lastWrite;
+	};
+
+	std::vector<file_t> files;
+	unsigned long long total = 0;
+
+	WIN32_FIND_DATA findData;
+	HANDLE find = FindFirstFile((directory + pattern).c_str(), &findData);
+
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	do {
+		file_t file;
+		file.path = directory + findData.cFileName;
+		file.size = ((unsigned long long)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+		file.lastWrite = ((unsigned long long)findData.ftLastWriteTime.dwHighDateTime << 32) | findData.ftLastWriteTime.dwLowDateTime;
+
+		total += file.size;
+		files.push_back(file);
+	} while (FindNextFile(find, &findData));
+
+	FindClose(find);
+
+	std::sort(files.begin(), files.end(), [](const file_t& a, const file_t& b) {
+		return a.lastWrite < b.lastWrite;
+	});
+
+	for (size_t i = 0; i < files.size() && total > maxBytes; ++i) {
+		if (DeleteFile(files[i].path.c_str())) {
+			total -= files[i].size;
+		}
+	}
+}
+
+// Value of a header in a raw CRLF header block, or "" if absent
+static tstring HttpHeaderValue(const tstring& headers, const TCHAR* name)
+{
+	size_t nameLength = _tcslen(name);
+	size_t start = 0;
+
+	while (start < headers.size()) {
+		size_t end = headers.find(TEXT("\r\n"), start);
+
+		if (end == tstring::npos) {
+			end = headers.size();
+		}
+
+		if (end - start > nameLength && headers[start + nameLength] == TEXT(':') && !_tcsnicmp(headers.c_str() + start, name, nameLength)) {
+			size_t valueStart = start + nameLength + 1;
+
+			while (valueStart < end && headers[valueStart] == TEXT(' ')) {
+				++valueStart;
+			}
+
+			return headers.substr(valueStart, end - valueStart);
+		}
+
+		start = end + 2;
+	}
+
+	return tstring();
+}
+
+// Status code from the status line at the start of a raw header block
+static int HttpHeadersStatus(const tstring& headers)
+{
+	size_t space = headers.find(TEXT(' '));
+
+	return space != tstring::npos ? _ttoi(headers.c_str() + space + 1) : 0;
+}
+
+static std::time_t HttpParseDate(const tstring& value)
+{
+	SYSTEMTIME systemTime;
+	FILETIME fileTime;
+
+	if (value.empty() || !InternetTimeToSystemTime(value.c_str(), &systemTime, 0) || !SystemTimeToFileTime(&systemTime, &fileTime)) {
+		return 0;
+	}
+
+	ULARGE_INTEGER ticks;
+	ticks.LowPart = fileTime.dwLowDateTime;
+	ticks.HighPart = fileTime.dwHighDateTime;
+
+	// 100ns intervals since 1601 to seconds since 1970
+	return (std::time_t)((ticks.QuadPart - 116444736000000000ULL) / 10000000ULL);
+}
+
+// Works out how long a response may be served without revalidation.
+// Returns false if it must not be stored at all.
+static bool HttpCacheFreshness(const tstring& headers, std::time_t now, std::time_t& freshUntil)
+{
+	tstring cacheControl = HttpHeaderValue(headers, TEXT("Cache-Control"));
+
+	for (size_t i = 0; i < cacheControl.size(); ++i) {
+		cacheControl[i] = _totlower(cacheControl[i]);
+	}
+
+	if (cacheControl.find(TEXT("no-store")) != tstring::npos) {
+		return false;
+	}
+
+	freshUntil = 0;
+
+	if (cacheControl.find(TEXT("no-cache")) != tstring::npos) {
+		return true;
+	}
+
+	size_t maxAge = cacheControl.find(TEXT("max-age="));
+
+	if (maxAge != tstring::npos) {
+		freshUntil = now + _ttoi(cacheControl.c_str() + maxAge + 8);
+		return true;
+	}
+
+	std::time_t expires = HttpParseDate(HttpHeaderValue(headers, TEXT("Expires")));
+	std::time_t date = HttpParseDate(HttpHeaderValue(headers, TEXT("Date")));
+
+	if (expires) {
+		// Relative to the server's clock when it sent a Date
+		freshUntil = date ? now + (expires - date) : expires;
+	}
+
+	return true;
+}
+
+// FNV-1a, as 16 hex digits
+static tstring HashString(const tstring& str)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < str.size(); ++i) {
+		hash = (hash ^ (unsigned long long)str[i]) * 1099511628211ULL;
+	}
+
+	TCHAR hex[32];
+	_stprintf_s(hex, sizeof(hex) / sizeof(hex[0]), TEXT("%016llx"), hash);
+
+	return hex;
+}
+
+struct http_cache_config_t {
+	tstring directory;
+	size_t memoryBytes;
+	unsigned long long diskBytes;
+};
+
+static http_cache_config_t HttpCacheConfig()
+{
+	std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+	http_cache_config_t config;
+	config.directory = g_configHttpCacheDirectory;
+	config.memoryBytes = g_configHttpCacheMemoryBytes;
+	config.diskBytes = g_configHttpCacheDiskBytes;
+
+	return config;
+}
+
+static tstring HttpCacheFilePath(const tstring& directory, const tstring& url)
+{
+	return directory + HashString(url) + TEXT(".cache");
+}
+
+static void HttpCacheMemoryEvict()
+{
+	while (g_httpCacheMemoryUsed > g_configHttpCacheMemoryBytes && !g_httpCacheLru.empty()) {
+		const http_cache_entry_t& oldest = g_httpCacheLru.back();
+
+		g_httpCacheMemoryUsed -= oldest.body.size();
+		g_httpCacheIndex.erase(oldest.url);
+		g_httpCacheLru.pop_back();
+	}
+}
+
+static void HttpCacheMemoryStore(const http_cache_entry_t& entry)
+{
+	std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+	auto it = g_httpCacheIndex.find(entry.url);
+
+	if (it != g_httpCacheIndex.end()) {
+		g_httpCacheMemoryUsed -= it->second->body.size();
+		g_httpCacheLru.erase(it->second);
+	}
+
+	g_httpCacheLru.push_front(entry);
+	g_httpCacheIndex[entry.url] = g_httpCacheLru.begin();
+	g_httpCacheMemoryUsed += entry.body.size();
+
+	HttpCacheMemoryEvict();
+}
+
+static void HttpCacheDiskStore(const http_cache_entry_t& entry)
+{
+	http_cache_config_t config = HttpCacheConfig();
+
+	if (!config.diskBytes) {
+		return;
+	}
+
+	std::string record;
+	SpoolAppendField(record, tchar_to_utf8(entry.url.c_str()));
+	SpoolAppendField(record, tchar_to_utf8(entry.headers.c_str()));
+	SpoolAppendField(record, tchar_to_utf8(entry.etag.c_str()));
+	SpoolAppendField(record, tchar_to_utf8(entry.lastModified.c_str()));
+	SpoolAppendField(record, std::to_string((long long)entry.freshUntil));
+	SpoolAppendField(record, entry.body);
+
+	std::lock_guard<std::mutex> lock(g_httpCacheDiskMutex);
+
+	if (FileWriteAtomic(HttpCacheFilePath(config.directory, entry.url), record)) {
+		DirectoryEvictLru(config.directory, TEXT("*.cache"), config.diskBytes);
+	}
+}
+
+static bool HttpCacheDiskLoad(const tstring& url, http_cache_entry_t& entry)
+{
+	http_cache_config_t config = HttpCacheConfig();
+
+	if (!config.diskBytes) {
+		return false;
+	}
+
+	std::string record;
+	std::string storedUrl, headers, etag, lastModified, freshUntil;
+	size_t offset = 0;
+
+	if (!FileReadAll(HttpCacheFilePath(config.directory, url), record) ||
+		!SpoolParseField(record, offset, storedUrl) ||
+		!SpoolParseField(record, offset, headers) ||
+		!SpoolParseField(record, offset, etag) ||
+		!SpoolParseField(record, offset, lastModified) ||
+		!SpoolParseField(record, offset, freshUntil) ||
+		!SpoolParseField(record, offset, entry.body)) {
+		return false;
+	}
+
+	entry.url = utf8_to_tstring(storedUrl);
+
+	if (entry.url != url) {
+		// Hash collision
+		return false;
+	}
+
+	entry.headers = utf8_to_tstring(headers);
+	entry.etag = utf8_to_tstring(etag);
+	entry.lastModified = utf8_to_tstring(lastModified);
+	entry.freshUntil = (std::time_t)strtoll(freshUntil.c_str(), NULL, 10);
+
+	return true;
+}
+
+static bool HttpCacheLookup(const tstring& url, http_cache_entry_t& entry)
+{
+	{
+		std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+		auto it = g_httpCacheIndex.find(url);
+
+		if (it != g_httpCacheIndex.end()) {
+			g_httpCacheLru.splice(g_httpCacheLru.begin(), g_httpCacheLru, it->second);
+			entry = *it->second;
+
+			return true;
+		}
+	}
+
+	if (!HttpCacheDiskLoad(url, entry)) {
+		return false;
+	}
+
+	HttpCacheMemoryStore(entry);
+
+	return true;
+}
+
+// GETs url through the cache. Returns the body in `body`, like a plain
+// HttpRequest would hand it to its response callback.
+static BOOL HttpCacheGet(const TCHAR* url, cancel_token_t* cancel, http_transfer_t* transfer, std::string& body)
+{
+	http_cache_entry_t entry;
+	bool cached = HttpCacheLookup(url, entry);
+	std::time_t now = std::time(nullptr);
+
+	if (cached && entry.freshUntil > now) {
+		StatsIncrement(g_stats.cacheHits);
+		StatsIncrement(g_stats.cacheBytesSaved, entry.body.size());
+
+		body = entry.body;
+
+		return TRUE;
+	}
+
+	tstring requestHeaders;
+
+	if (cached && entry.etag.size()) {
+		requestHeaders += TEXT("If-None-Match: ") + entry.etag + TEXT("\r\n");
+	}
+
+	if (cached && entry.lastModified.size()) {
+		requestHeaders += TEXT("If-Modified-Since: ") + entry.lastModified + TEXT("\r\n");
+	}
+
+	tstring responseHeaders;
+	std::string responseBody;
+
+	BOOL bResult = HttpRequest(
+		TEXT("GET"),
+		url,
+		NULL, // user-agent
+		requestHeaders.size() ? requestHeaders.c_str() : NULL,
+		requestHeaders.size(),
+		NULL,
+		0,
+		[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+			if (responseHeaders.empty()) {
+				responseHeaders = headers;
+			}
+
+			responseBody.append((char*)buffer, buffer_len);
+
+			return true;
+		},
+		cancel,
+		transfer);
+
+	if (!bResult) {
+		return FALSE;
+	}
+
+	int status = HttpHeadersStatus(responseHeaders);
+
+	if (cached && status == HTTP_STATUS_NOT_MODIFIED) {
+		StatsIncrement(g_stats.cacheRevalidated);
+		StatsIncrement(g_stats.cacheBytesSaved, entry.body.size());
+
+		// A 304 carries the current freshness and may carry new validators
+		std::time_t freshUntil = 0;
+
+		if (HttpCacheFreshness(responseHeaders, now, freshUntil)) {
+			entry.freshUntil = freshUntil;
+		}
+
+		tstring etag = HttpHeaderValue(responseHeaders, TEXT("ETag"));
+
+		if (etag.size()) {
+			entry.etag = etag;
+		}
+
+		HttpCacheMemoryStore(entry);
+		HttpCacheDiskStore(entry);
+
+		body = entry.body;
+
+		return TRUE;
+	}
+
+	StatsIncrement(g_stats.cacheMisses);
+
+	body = responseBody;
+
+	http_cache_entry_t fresh;
+	fresh.url = url;
+	fresh.headers = responseHeaders;
+	fresh.etag = HttpHeaderValue(responseHeaders, TEXT("ETag"));
+	fresh.lastModified = HttpHeaderValue(responseHeaders, TEXT("Last-Modified"));
+
+	if (status == HTTP_STATUS_OK &&
+		HttpCacheFreshness(responseHeaders, now, fresh.freshUntil) &&
+		(fresh.freshUntil > now || fresh.etag.size() || fresh.lastModified.size()) &&
+		responseBody.size() <= HttpCacheConfig().memoryBytes) {
+		fresh.body = std::move(responseBody);
+
+		HttpCacheMemoryStore(fresh);
+		HttpCacheDiskStore(fresh);
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Single flight
+///////////////////////////////////////////////////////////////////////
+
+// Identical idempotent requests made while one is already in flight (say
+// the same manifest GET from two sections) wait for that one instead of
+// going to the network themselves, and share its response buffer.
+typedef std::shared_ptr<const std::string> shared_body_t;
+
+struct single_flight_t {
+	std::mutex mutex;
+	std::condition_variable finished;
+	bool done;
+	BOOL result;
+	shared_body_t body;
+};
+
+static std::map<tstring, std::shared_ptr<single_flight_t>> g_singleFlights;
+static std::mutex g_singleFlightsMutex;
+
+static tstring SingleFlightKey(const TCHAR* verb, const TCHAR* url, const TCHAR* headers)
+{
+	tstring key = verb;
+	key += TEXT('\n');
+	key += url;
+	key += TEXT('\n');
+	key += headers ? headers : TEXT("");
+
+	return key;
+}
+
+// Runs fetch for the first caller with a given key; callers arriving
+// while it runs get its result and body instead.
+template <typename Fetch>
+static BOOL SingleFlight(const tstring& key, Fetch fetch, shared_body_t& body)
+{
+	std::shared_ptr<single_flight_t> flight;
+	bool leader = false;
+
+	{
+		std::lock_guard<std::mutex> lock(g_singleFlightsMutex);
+
+		std::shared_ptr<single_flight_t>& entry = g_singleFlights[key];
+
+		if (!entry) {
+			entry = std::make_shared<single_flight_t>();
+			entry->done = false;
+			entry->result = FALSE;
+			leader = true;
+		}
+
+		flight = entry;
+	}
+
+	if (!leader) {
+		StatsIncrement(g_stats.singleFlightShared);
+
+		std::unique_lock<std::mutex> lock(flight->mutex);
+
+		flight->finished.wait(lock, [&]() { return flight->done; });
+
+		body = flight->body;
+
+		return flight->result;
+	}
+
+	std::string buffer;
+	BOOL result = fetch(buffer);
+
+	body = std::make_shared<const std::string>(std::move(buffer));
+
+	{
+		std::lock_guard<std::mutex> lock(g_singleFlightsMutex);
+
+		g_singleFlights.erase(key);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(flight->mutex);
+
+		flight->done = true;
+		flight->result = result;
+		flight->body = body;
+	}
+
+	flight->finished.notify_all();
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Hedging
+///////////////////////////////////////////////////////////////////////
+
+// Optional hedging for GETs, enabled with HttpSetHedging. The first attempt
+// runs on the calling thread while a timer-queue timer watches it: if it
+// hasn't had its first byte by the configured percentile of recent
+// time-to-first-byte, an identical second attempt is started on a thread of
+// its own; whichever succeeds first wins and the other is cancelled. Hedges
+// are capped at a percentage of hedged-eligible requests so a slow backend
+// doesn't get twice the load.
+struct hedge_attempt_t {
+	cancel_token_t cancel;
+	std::string body;
+	BOOL result;
+	bool started;
+	bool firstByte;
+	bool done;
+};
+
+// Shared by the caller running the first attempt, the timer watching it and
+// the thread running the hedge
+struct hedge_t {
+	std::mutex mutex;
+	std::condition_variable changed;
+	hedge_attempt_t attempts[2];
+	std::thread hedgeThread; // set by the timer before it starts the hedge
+	const TCHAR* hedgeUrl;
+	cancel_token_t* cancel; // of the whole request
+	ULONGLONG startTicks;
+	ULONGLONG delay;
+	int winner; // -1 until an attempt succeeds
+};
+
+// How often the timer checks on the first attempt and the request's cancel
+static const DWORD HEDGE_POLL_MILLISECONDS = 50;
+
+static const size_t HEDGE_SAMPLES = 256;
+static const size_t HEDGE_MIN_SAMPLES = 16;
+
+static int g_configHedgePercentile = 0; // 0 when disabled
+static int g_configHedgeBudgetPercent = 10;
+
+static std::deque<ULONGLONG> g_hedgeFirstByteSamples;
+static std::mutex g_hedgeMutex;
+static std::atomic<unsigned long long> g_hedgeRequests(0);
+static std::atomic<unsigned long long> g_hedgesIssued(0);
+
+static void HedgeRecordFirstByte(ULONGLONG milliseconds)
+{
+	std::lock_guard<std::mutex> lock(g_hedgeMutex);
+
+	g_hedgeFirstByteSamples.push_back(milliseconds);
+
+	if (g_hedgeFirstByteSamples.size() > HEDGE_SAMPLES) {
+		g_hedgeFirstByteSamples.pop_front();
+	}
+}
+
+// How long to give the first attempt, or 0 if there's no basis to hedge on yet
+static ULONGLONG HedgeDelay()
+{
+	std::lock_guard<std::mutex> lock(g_hedgeMutex);
+
+	if (!g_configHedgePercentile || g_hedgeFirstByteSamples.size() < HEDGE_MIN_SAMPLES) {
+		return 0;
+	}
+
+	std::vector<ULONGLONG> samples(g_hedgeFirstByteSamples.begin(), g_hedgeFirstByteSamples.end());
+	size_t index = samples.size() * g_configHedgePercentile / 100;
+
+	if (index >= samples.size()) {
+		index = samples.size() - 1;
+	}
+
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+
+	return samples[index] ? samples[index] : 1;
+}
+
+static bool HedgeBudgetAllows()
+{
+	return (g_hedgesIssued + 1) * 100 <= g_hedgeRequests * g_configHedgeBudgetPercent;
+}
+
+// Runs one attempt. The first to succeed wins and cancels the other.
+static void HedgeRunAttempt(hedge_t& hedge, int index, const TCHAR* url)
+{
+	hedge_attempt_t& attempt = hedge.attempts[index];
+	ULONGLONG attemptStartTicks = GetTickCount64();
+
+	BOOL result = HttpRequest(
+		TEXT("GET"),
+		url,
+		NULL, // user-agent
+		NULL,
+		0,
+		NULL,
+		0,
+		[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+			if (!attempt.firstByte) {
+				HedgeRecordFirstByte(GetTickCount64() - attemptStartTicks);
+
+				std::lock_guard<std::mutex> lock(hedge.mutex);
+
+				attempt.firstByte = true;
+			}
+
+			attempt.body.append((char*)buffer, buffer_len);
+
+			return true;
+		},
+		&attempt.cancel);
+
+	bool won = false;
+
+	{
+		std::lock_guard<std::mutex> lock(hedge.mutex);
+
+		attempt.result = result && !attempt.cancel.cancelled;
+		attempt.done = true;
+
+		if (attempt.result && hedge.winner < 0) {
+			hedge.winner = index;
+			won = true;
+		}
+	}
+
+	if (won) {
+		CancelTokenCancel(&hedge.attempts[1 - index].cancel);
+	}
+
+	hedge.changed.notify_all();
+}
+
+// Passes a cancel of the whole request on to the attempts, and starts the
+// hedge once the first attempt is overdue
+static void CALLBACK HedgeTimerCallback(PVOID parameter, BOOLEAN)
+{
+	hedge_t& hedge = *(hedge_t*)parameter;
+
+	if (hedge.cancel && hedge.cancel->cancelled) {
+		CancelTokenCancel(&hedge.attempts[0].cancel);
+		CancelTokenCancel(&hedge.attempts[1].cancel);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(hedge.mutex);
+
+		const hedge_attempt_t& first = hedge.attempts[0];
+
+		if (hedge.attempts[1].started || first.firstByte || first.done ||
+			!hedge.delay || GetTickCount64() - hedge.startTicks < hedge.delay || !HedgeBudgetAllows()) {
+			return;
+		}
+
+		++g_hedgesIssued;
+
+		hedge.attempts[1].started = true;
+	}
+
+	hedge.hedgeThread = std::thread(HedgeRunAttempt, std::ref(hedge), 1, hedge.hedgeUrl);
+}
+
+// GETs url, hedging to hedgeUrl (which may be the same URL, or a mirror).
+// Returns the body of the winning attempt.
+static BOOL HttpHedgedGet(const TCHAR* url, const TCHAR* hedgeUrl, cancel_token_t* cancel, std::string& body)
+{
+	hedge_t hedge;
+	hedge.hedgeUrl = hedgeUrl;
+	hedge.cancel = cancel;
+	hedge.startTicks = GetTickCount64();
+	hedge.delay = HedgeDelay();
+	hedge.winner = -1;
+
+	++g_hedgeRequests;
+
+	for (int i = 0; i < 2; ++i) {
+		hedge.attempts[i].cancel.id = 0;
+		hedge.attempts[i].cancel.cancelled = cancel && cancel->cancelled;
+		hedge.attempts[i].result = FALSE;
+		hedge.attempts[i].started = false;
+		hedge.attempts[i].firstByte = false;
+		hedge.attempts[i].done = false;
+	}
+
+	HANDLE timer = NULL;
+
+	if (!CreateTimerQueueTimer(&timer, NULL, HedgeTimerCallback, &hedge, HEDGE_POLL_MILLISECONDS, HEDGE_POLL_MILLISECONDS, WT_EXECUTEDEFAULT)) {
+		// Neither hedged nor cancellable once started, like a plain request
+		// without a token
+		timer = NULL;
+	}
+
+	hedge.attempts[0].started = true;
+
+	HedgeRunAttempt(hedge, 0, url);
+
+	{
+		// If the first attempt failed the hedge may still succeed; if it won
+		// the hedge has been cancelled. The timer keeps passing on a cancel
+		// of the whole request meanwhile.
+		std::unique_lock<std::mutex> lock(hedge.mutex);
+
+		hedge.changed.wait(lock, [&]() { return !hedge.attempts[1].started || hedge.attempts[1].done; });
+	}
+
+	if (timer) {
+		// Waits for a callback in progress, which may still be setting hedgeThread
+		DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+	}
+
+	if (hedge.hedgeThread.joinable()) {
+		hedge.hedgeThread.join();
+	}
+
+	if (hedge.winner < 0) {
+		return FALSE;
+	}
+
+	if (hedge.winner == 1) {
+		StatsIncrement(g_stats.hedgeWins);
+	}
+
+	body = std::move(hedge.attempts[hedge.winner].body);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Waiting
+///////////////////////////////////////////////////////////////////////
+
+// Waits for the event while dispatching window messages, so an installer
+// page that calls one of the Wait functions keeps painting and responding.
+static void WaitPumpingMessages(HANDLE event)
+{
+	for (;;) {
+		DWORD result = MsgWaitForMultipleObjectsEx(1, &event, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+
+		if (result == WAIT_OBJECT_0) {
+			return;
+		}
+		else if (result != WAIT_OBJECT_0 + 1) {
+			// Cannot pump (e.g. WAIT_FAILED): the caller must still not
+			// return before the event is set
+			WaitForSingleObject(event, INFINITE);
+			return;
+		}
+
+		MSG msg;
+
+		while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+			if (msg.message == WM_QUIT) {
+				// Leave it for the installer's own loop
+				PostQuitMessage((int)msg.wParam);
+				WaitForSingleObject(event, INFINITE);
+				return;
+			}
+
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
+}
+
+// Runs fn for one of the Wait functions on a thread of its own, so it is
+// never batched, evicted or stuck behind the asynchronous queue. Returns
+// once fn has.
+template <typename Fn>
+static void WaitRun(Fn fn)
+{
+	HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	auto run = [&]() {
+		++g_foregroundTransfers;
+		fn();
+		--g_foregroundTransfers;
+
+		if (done) {
+			SetEvent(done);
+		}
+	};
+
+	if (!done) {
+		run();
+	}
+	else {
+		std::thread thread(run);
+
+		WaitPumpingMessages(done);
+
+		thread.join();
+	}
+
+	if (done) {
+		CloseHandle(done);
+	}
+}
+
+// Returns the response body, or "error"
+static tstring HttpRequestWait(const TCHAR* verb, const TCHAR* url, const TCHAR* headers, const std::string& content)
+{
+	shared_body_t response_body;
+	BOOL bResult = FALSE;
+	cancel_token_ptr_t cancel = CancelTokenGet(TEXT(""));
+	bool idempotent = (!_tcscmp(verb, TEXT("GET")) || !_tcscmp(verb, TEXT("HEAD"))) && content.empty();
+
+	auto fetch = [&](std::string& response_buffer) -> BOOL {
+		// The cache takes precedence over hedging: its conditional
+		// revalidation requests are not hedged
+		if (g_httpCacheEnabled && !_tcscmp(verb, TEXT("GET")) && !headers && content.empty()) {
+			return HttpCacheGet(url, cancel.get(), NULL, response_buffer);
+		}
+		else if (g_configHedgePercentile && !_tcscmp(verb, TEXT("GET")) && !headers && content.empty()) {
+			return HttpHedgedGet(url, url, cancel.get(), response_buffer);
+		}
+		else {
+			return HttpRequest(
+				verb,
+				url,
+				NULL, // user-agent
+				headers,
+				headers ? _tcslen(headers) : 0,
+				content.size() ? content.c_str() : NULL,
+				content.size(),
+				[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+					response_buffer.append((char*)buffer, buffer_len);
+
+					return true;
+				},
+				cancel.get());
+		}
+	};
+
+	WaitRun([&]() {
+		if (idempotent) {
+			bResult = SingleFlight(SingleFlightKey(verb, url, headers), fetch, response_body);
+		}
+		else {
+			std::string response_buffer;
+
+			bResult = fetch(response_buffer);
+			response_body = std::make_shared<const std::string>(std::move(response_buffer));
+		}
+	});
+
+	return bResult ? utf8_to_tstring(*response_body) : tstring(TEXT("error"));
+}
+
+///////////////////////////////////////////////////////////////////////
+// Component store
+///////////////////////////////////////////////////////////////////////
+
+// Downloads that declare the SHA-256 of their payload go through a
+// content-addressed store shared by every installer run on the machine,
+// enabled with HttpSetComponentStore. A blob already in the store is
+// re-hashed and hard-linked to the destination (copied if that fails, e.g.
+// across volumes) without any network I/O. A new download is written to a
+// ".part" file in the store, hashed on the way and renamed into place once
+// it checks out. A named mutex serialises commits, links and eviction
+// between installers running at once; the downloads themselves run
+// unlocked. Least recently used blobs go once the store outgrows its limit.
+enum download_result_t {
+	DOWNLOAD_OK,
+	DOWNLOAD_FAILED,
+	DOWNLOAD_HASH_MISMATCH,
+};
+
+struct sha256_t {
+	BCRYPT_ALG_HANDLE algorithm;
+	BCRYPT_HASH_HANDLE hash;
+};
+
+static tstring g_configComponentStoreDirectory; // empty when disabled
+static unsigned long long g_configComponentStoreMaxBytes = 0;
+static HANDLE g_componentStoreMutex = NULL;
+
+static bool Sha256Init(sha256_t& sha)
+{
+	sha.algorithm = NULL;
+	sha.hash = NULL;
+
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&sha.algorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0))) {
+		return false;
+	}
+
+	if (!BCRYPT_SUCCESS(BCryptCreateHash(sha.algorithm, &sha.hash, NULL, 0, NULL, 0, 0))) {
+		BCryptCloseAlgorithmProvider(sha.algorithm, 0);
+		return false;
+	}
+
+	return true;
+}
+
+static void Sha256Update(sha256_t& sha, const void* data, size_t length)
+{
+	BCryptHashData(sha.hash, (BYTE*)data, (ULONG)length, 0);
+}
+
+// Lower-case hex digest; releases the hash either way
+static tstring Sha256Final(sha256_t& sha)
+{
+	BYTE digest[32];
+	tstring hex;
+
+	if (BCRYPT_SUCCESS(BCryptFinishHash(sha.hash, digest, sizeof(digest), 0))) {
+		static const TCHAR DIGITS[] = TEXT("0123456789abcdef");
+
+		for (size_t i = 0; i < sizeof(digest); ++i) {
+			hex += DIGITS[digest[i] >> 4];
+			hex += DIGITS[digest[i] & 0xf];
+		}
+	}
+
+	BCryptDestroyHash(sha.hash);
+	BCryptCloseAlgorithmProvider(sha.algorithm, 0);
+
+	return hex;
+}
+
+static tstring Sha256File(const tstring& path)
+{
+	HANDLE file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return tstring();
+	}
+
+	sha256_t sha;
+
+	if (!Sha256Init(sha)) {
+		CloseHandle(file);
+		return tstring();
+	}
+
+	const size_t BUFFER_LEN = 65536;
+	char* buffer = new char[BUFFER_LEN];
+	DWORD bytesRead = 0;
+
+	while (ReadFile(file, buffer, BUFFER_LEN, &bytesRead, NULL) && bytesRead) {
+		Sha256Update(sha, buffer, bytesRead);
+	}
+
+	delete[] buffer;
+	CloseHandle(file);
+
+	return Sha256Final(sha);
+}
+
+// Holds the cross-process store mutex for its lifetime
+struct component_store_lock_t {
+	bool locked;
+
+	component_store_lock_t() : locked(false)
+	{
+		if (g_componentStoreMutex) {
+			DWORD result = WaitForSingleObject(g_componentStoreMutex, INFINITE);
+
+			// An installer that died holding it leaves nothing half-done:
+			// every change under the lock is a single rename, link or delete.
+			locked = result == WAIT_OBJECT_0 || result == WAIT_ABANDONED;
+		}
+	}
+
+	~component_store_lock_t()
+	{
+		if (locked) {
+			ReleaseMutex(g_componentStoreMutex);
+		}
+	}
+};
+
+static tstring ComponentStoreBlobPath(const tstring& hash)
+{
+	return g_configComponentStoreDirectory + hash + TEXT(".blob");
+}
+
+// Marks a blob as recently used for eviction
+static void ComponentStoreTouch(const tstring& blobPath)
+{
+	HANDLE file = CreateFile(blobPath.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file != INVALID_HANDLE_VALUE) {
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+
+		SetFileTime(file, NULL, NULL, &now);
+		CloseHandle(file);
+	}
+}
+
+static bool ComponentStorePlace(const tstring& blobPath, const tstring& path)
+{
+	DeleteFile(path.c_str());
+
+	return CreateHardLink(path.c_str(), blobPath.c_str(), NULL) || CopyFile(blobPath.c_str(), path.c_str(), FALSE);
+}
+
+// Places the blob with the given hash at path if the store has an intact copy
+static bool ComponentStoreFetch(const tstring& hash, const tstring& path)
+{
+	if (g_configComponentStoreDirectory.empty()) {
+		return false;
+	}
+
+	tstring blobPath = ComponentStoreBlobPath(hash);
+
+	if (GetFileAttributes(blobPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
+		return false;
+	}
+
+	// Re-hashed because a hard-linked copy may have been modified in place
+	bool intact = Sha256File(blobPath) == hash;
+
+	component_store_lock_t lock;
+
+	if (!intact) {
+		DeleteFile(blobPath.c_str());
+		return false;
+	}
+
+	if (!ComponentStorePlace(blobPath, path)) {
+		return false;
+	}
+
+	ComponentStoreTouch(blobPath);
+
+	return true;
+}
+
+// True while the process with the given id runs. A reused id only keeps an
+// orphaned ".part" around until that process exits as well.
+static bool ProcessRunning(DWORD processId)
+{
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+
+	if (!process) {
+		// Access denied means it exists, just not as ours to query
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+
+	DWORD exitCode = 0;
+	bool running = GetExitCodeProcess(process, &exitCode) && exitCode == STILL_ACTIVE;
+
+	CloseHandle(process);
+
+	return running;
+}
+
+// Deletes ".part" files left behind by installers that are no longer
+// running. A live download's file may be closed while it is being hashed
+// and waiting for the store lock, so being closed doesn't make it stale;
+// the process id in its name (<hash>.<pid>.<tid>.part) says whose it is.
+// Callers hold the store lock.
+static void ComponentStoreEvictStaleParts()
+{
+	WIN32_FIND_DATA findData;
+	HANDLE find = FindFirstFile((g_configComponentStoreDirectory + TEXT("*.part")).c_str(), &findData);
+
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	std::vector<tstring> stale;
+
+	do {
+		tstring name = findData.cFileName;
+		size_t tidStart = name.rfind(TEXT('.'), name.size() - 6); // before ".part"
+		size_t pidStart = tidStart != tstring::npos && tidStart ? name.rfind(TEXT('.'), tidStart - 1) : tstring::npos;
+
+		if (pidStart != tstring::npos && ProcessRunning(_tcstoul(name.c_str() + pidStart + 1, NULL, 10))) {
+			continue;
+		}
+
+		stale.push_back(g_configComponentStoreDirectory + name);
+	} while (FindNextFile(find, &findData));
+
+	FindClose(find);
+
+	for (size_t i = 0; i < stale.size(); ++i) {
+		DeleteFile(stale[i].c_str());
+	}
+}
+
+// Moves a verified download into the store and places it at path
+static bool ComponentStoreCommit(const tstring& partPath, const tstring& hash, const tstring& path)
+{
+	tstring blobPath = ComponentStoreBlobPath(hash);
+
+	component_store_lock_t lock;
+
+	if (!MoveFileEx(partPath.c_str(), blobPath.c_str(), MOVEFILE_WRITE_THROUGH)) {
+		// Most likely another installer committed the same blob first
+		DeleteFile(partPath.c_str());
+	}
+
+	bool placed = ComponentStorePlace(blobPath, path);
+
+	ComponentStoreTouch(blobPath);
+
+	DirectoryEvictLru(g_configComponentStoreDirectory, TEXT("*.blob"), g_configComponentStoreMaxBytes);
+	ComponentStoreEvictStaleParts();
+
+	return placed;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Mirrors
+///////////////////////////////////////////////////////////////////////
+
+// Downloads can be given several mirrors of the same payload. Each mirror
+// host keeps an EWMA of its time to first byte and its throughput, and
+// mirrors are ranked by the time they'd be expected to take; ones not tried
+// yet rank first so they get measured, and ones that failed recently rank
+// last. A transfer that breaks off carries on from where it stopped on the
+// next mirror with a Range request. Large files can be split into segments
+// fetched from different mirrors at once.
+struct mirror_stats_t {
+	double firstByteMilliseconds;
+	double bytesPerSecond;
+	ULONGLONG lastFailureTicks;
+	bool measured;
+};
+
+// A byte range of a download and the handle it's written through
+struct download_range_t {
+	HANDLE file;
+	unsigned long long start; // next byte to fetch
+	unsigned long long end; // one past the last byte, 0 if unknown
+	bool segment; // part of a segmented download rather than the whole file
+	sha256_t* sha; // hashed in order when set; whole-file ranges only
+};
+
+static const double MIRROR_EWMA_WEIGHT = 0.3;
+static const ULONGLONG MIRROR_FAILURE_PENALTY_MILLISECONDS = 30 * 1000;
+static const unsigned long long MIRROR_THROUGHPUT_MIN_BYTES = 64 * 1024;
+static const unsigned long long DOWNLOAD_SEGMENT_MIN_BYTES = 1024 * 1024;
+
+static std::map<tstring, mirror_stats_t> g_mirrorStats;
+static std::mutex g_mirrorStatsMutex;
+
+static tstring MirrorKey(const tstring& url)
+{
+	tstring key = HttpUrlHostKey(url.c_str());
+
+	return key.size() ? key : url;
+}
+
+static void MirrorRecord(const tstring& url, ULONGLONG firstByteMilliseconds, unsigned long long bytes, ULONGLONG transferMilliseconds)
+{
+	std::lock_guard<std::mutex> lock(g_mirrorStatsMutex);
+
+	mirror_stats_t& stats = g_mirrorStats[MirrorKey(url)];
+	double bytesPerSecond = transferMilliseconds ? (double)bytes * 1000 / transferMilliseconds : 0;
+	bool sampleThroughput = bytes >= MIRROR_THROUGHPUT_MIN_BYTES && bytesPerSecond > 0;
+
+	if (!stats.measured) {
+		stats.firstByteMilliseconds = (double)firstByteMilliseconds;
+		stats.bytesPerSecond = sampleThroughput ? bytesPerSecond : 0;
+		stats.measured = true;
+		return;
+	}
+
+	stats.firstByteMilliseconds += MIRROR_EWMA_WEIGHT * ((double)firstByteMilliseconds - stats.firstByteMilliseconds);
+
+	if (sampleThroughput) {
+		stats.bytesPerSecond = stats.bytesPerSecond ? stats.bytesPerSecond + MIRROR_EWMA_WEIGHT * (bytesPerSecond - stats.bytesPerSecond) : bytesPerSecond;
+	}
+}
+
+static void MirrorRecordFailure(const tstring& url)
+{
+	StatsIncrement(g_stats.mirrorFailovers);
+
+	std::lock_guard<std::mutex> lock(g_mirrorStatsMutex);
+
+	g_mirrorStats[MirrorKey(url)].lastFailureTicks = GetTickCount64();
+}
+
+// Mirror indices, best first, for a transfer of about `bytes`
+static std::vector<size_t> MirrorRank(const std::vector<tstring>& urls, unsigned long long bytes)
+{
+	std::vector<double> scores(urls.size());
+	ULONGLONG now = GetTickCount64();
+
+	{
+		std::lock_guard<std::mutex> lock(g_mirrorStatsMutex);
+
+		for (size_t i = 0; i < urls.size(); ++i) {
+			auto it = g_mirrorStats.find(MirrorKey(urls[i]));
+
+			if (it == g_mirrorStats.end() || !it->second.measured) {
+				scores[i] = 0;
+				continue;
+			}
+
+			const mirror_stats_t& stats = it->second;
+
+			scores[i] = stats.firstByteMilliseconds;
+
+			if (stats.bytesPerSecond > 0) {
+				scores[i] += (double)bytes * 1000 / stats.bytesPerSecond;
+			}
+
+			if (stats.lastFailureTicks && now - stats.lastFailureTicks < MIRROR_FAILURE_PENALTY_MILLISECONDS) {
+				scores[i] += 1e12;
+			}
+		}
+	}
+
+	std::vector<size_t> ranking(urls.size());
+
+	for (size_t i = 0; i < ranking.size(); ++i) {
+		ranking[i] = i;
+	}
+
+	std::stable_sort(ranking.begin(), ranking.end(), [&](size_t a, size_t b) {
+		return scores[a] < scores[b];
+	});
+
+	return ranking;
+}
+
+// Total size from a 200's Content-Length or a 206's Content-Range, 0 if unknown
+static unsigned long long HttpResponseTotalSize(const tstring& headers, int status)
+{
+	if (status == HTTP_STATUS_PARTIAL_CONTENT) {
+		tstring range = HttpHeaderValue(headers, TEXT("Content-Range"));
+		size_t slash = range.find(TEXT('/'));
+
+		return slash != tstring::npos ? _tcstoui64(range.c_str() + slash + 1, NULL, 10) : 0;
+	}
+
+	return _tcstoui64(HttpHeaderValue(headers, TEXT("Content-Length")).c_str(), NULL, 10);
+}
+
+// Size of the payload and whether byte ranges can be requested, from a HEAD
+static bool HttpProbeRanges(const tstring& url, unsigned long long& size, cancel_token_t* cancel)
+{
+	tstring responseHeaders;
+
+	BOOL bResult = HttpRequest(
+		TEXT("HEAD"),
+		url.c_str(),
+		NULL, // user-agent
+		NULL,
+		0,
+		NULL,
+		0,
+		[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+			responseHeaders = headers;
+
+			return false;
+		},
+		cancel);
+
+	if (!bResult || HttpHeadersStatus(responseHeaders) != HTTP_STATUS_OK) {
+		return false;
+	}
+
+	tstring acceptRanges = HttpHeaderValue(responseHeaders, TEXT("Accept-Ranges"));
+
+	size = HttpResponseTotalSize(responseHeaders, HTTP_STATUS_OK);
+
+	return size && !_tcsicmp(acceptRanges.c_str(), TEXT("bytes"));
+}
+
+// Fetches the range, starting with the preferred mirror and failing over to
+// the others on error. Every mirror gets two chances.
+static bool HttpDownloadRange(const std::vector<tstring>& urls, size_t preferred, download_range_t& range, cancel_token_t* cancel)
+{
+	std::vector<bool> failed(urls.size(), false);
+
+	for (size_t tries = 0; tries < urls.size() * 2; ++tries) {
+		if (cancel && cancel->cancelled) {
+			return false;
+		}
+
+		if (std::find(failed.begin(), failed.end(), false) == failed.end()) {
+			failed.assign(urls.size(), false);
+		}
+
+		size_t mirror = preferred;
+
+		if (tries || failed[mirror]) {
+			std::vector<size_t> ranking = MirrorRank(urls, range.end ? range.end - range.start : DOWNLOAD_SEGMENT_MIN_BYTES);
+
+			for (size_t i = 0; i < ranking.size(); ++i) {
+				if (!failed[ranking[i]]) {
+					mirror = ranking[i];
+					break;
+				}
+			}
+		}
+
+		tstring rangeHeader;
+
+		if (range.start || range.end) {
+			rangeHeader = TEXT("Range: bytes=") + to_tstring(range.start) + TEXT("-");
+
+			if (range.end) {
+				rangeHeader += to_tstring(range.end - 1);
+			}
+
+			rangeHeader += TEXT("\r\n");
+		}
+
+		LARGE_INTEGER offset;
+		offset.QuadPart = (LONGLONG)range.start;
+
+		if (!SetFilePointerEx(range.file, offset, NULL, FILE_BEGIN)) {
+			return false;
+		}
+
+		int status = 0;
+		bool written = true;
+		unsigned long long received = 0;
+		ULONGLONG startTicks = GetTickCount64();
+		ULONGLONG firstByteTicks = 0;
+
+		BOOL bResult = HttpRequest(
+			TEXT("GET"),
+			urls[mirror].c_str(),
+			NULL, // user-agent
+			rangeHeader.size() ? rangeHeader.c_str() : NULL,
+			rangeHeader.size(),
+			NULL,
+			0,
+			[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+				if (!status) {
+					status = HttpHeadersStatus(headers);
+					firstByteTicks = GetTickCount64();
+
+					if (status == HTTP_STATUS_OK && range.start) {
+						// The mirror ignored the range. A whole-file download
+						// can start over; a segment can't use this mirror.
+						LARGE_INTEGER zero;
+						zero.QuadPart = 0;
+
+						if (range.segment || !SetFilePointerEx(range.file, zero, NULL, FILE_BEGIN) || !SetEndOfFile(range.file)) {
+							written = false;
+							return false;
+						}
+
+						if (range.sha) {
+							Sha256Final(*range.sha);
+
+							if (!Sha256Init(*range.sha)) {
+								range.sha = NULL;
+								written = false;
+								return false;
+							}
+						}
+
+						range.start = 0;
+						range.end = 0;
+					}
+					else if (status != HTTP_STATUS_OK && status != HTTP_STATUS_PARTIAL_CONTENT) {
+						written = false;
+						return false;
+					}
+
+					if (!range.end) {
+						range.end = HttpResponseTotalSize(headers, status);
+					}
+				}
+
+				size_t length = buffer_len;
+
+				if (range.end && range.start + length > range.end) {
+					length = (size_t)(range.end - range.start);
+				}
+
+				DWORD bytesWritten = 0;
+
+				if (length && (!WriteFile(range.file, buffer, (DWORD)length, &bytesWritten, NULL) || bytesWritten != length)) {
+					written = false;
+					return false;
+				}
+
+				if (range.sha) {
+					Sha256Update(*range.sha, buffer, length);
+				}
+
+				range.start += length;
+				received += length;
+
+				return !range.end || range.start < range.end;
+			},
+			cancel);
+
+		if (firstByteTicks) {
+			MirrorRecord(urls[mirror], firstByteTicks - startTicks, received, GetTickCount64() - firstByteTicks);
+		}
+
+		// A dropped connection or broken chunked body fails the read, and so
+		// HttpRequest. Without a known size, a body that ended without a read
+		// error is taken as complete: only a server that closes the
+		// connection to end an unsized body can still cut it short unnoticed,
+		// and the hash check catches that when there is one.
+		if (bResult && written && status && (!range.end || range.start >= range.end)) {
+			return true;
+		}
+
+		MirrorRecordFailure(urls[mirror]);
+		failed[mirror] = true;
+	}
+
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Downloads
+///////////////////////////////////////////////////////////////////////
+
+// Downloads from the mirrors to path, through the component store when a
+// hash is given. With segments > 1 and a payload of at least that many
+// megabytes from mirrors that take ranges, the segments are fetched in
+// parallel, spread over the best mirrors.
+static download_result_t HttpDownloadFile(const std::vector<tstring>& urls, const tstring& path, const tstring& expectedHash, int segments, cancel_token_t* cancel)
+{
+	tstring hash = expectedHash;
+
+	for (size_t i = 0; i < hash.size(); ++i) {
+		hash[i] = _totlower(hash[i]);
+	}
+
+	if (hash.size() && ComponentStoreFetch(hash, path)) {
+		StatsIncrement(g_stats.storeHits);
+		return DOWNLOAD_OK;
+	}
+
+	if (urls.empty()) {
+		return DOWNLOAD_FAILED;
+	}
+
+	bool useStore = hash.size() && g_configComponentStoreDirectory.size();
+	tstring partPath = (useStore ? g_configComponentStoreDirectory + hash : path) +
+		TEXT(".") + to_tstring(GetCurrentProcessId()) + TEXT(".") + to_tstring(GetCurrentThreadId()) + TEXT(".part");
+
+	HANDLE file = CreateFile(partPath.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return DOWNLOAD_FAILED;
+	}
+
+	std::vector<size_t> ranking = MirrorRank(urls, DOWNLOAD_SEGMENT_MIN_BYTES);
+	unsigned long long size = 0;
+	bool complete = false;
+	tstring actualHash;
+
+	if (segments > 1 &&
+		HttpProbeRanges(urls[ranking[0]], size, cancel) &&
+		size >= (unsigned long long)segments * DOWNLOAD_SEGMENT_MIN_BYTES) {
+		StatsIncrement(g_stats.segmentedDownloads);
+
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)size;
+
+		std::vector<download_range_t> ranges(segments);
+		std::vector<std::function<void()>> jobs;
+		std::vector<char> done(segments, 0);
+		bool allocated = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+
+		for (int i = 0; i < segments && allocated; ++i) {
+			ranges[i].file = CreateFile(partPath.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			ranges[i].start = size * i / segments;
+			ranges[i].end = size * (i + 1) / segments;
+			ranges[i].segment = true;
+			ranges[i].sha = NULL;
+
+			jobs.push_back([&, i]() {
+				done[i] = ranges[i].file != INVALID_HANDLE_VALUE && HttpDownloadRange(urls, ranking[i % ranking.size()], ranges[i], cancel);
+			});
+		}
+
+		TaskRunParallel(jobs);
+
+		complete = allocated && std::find(done.begin(), done.end(), 0) == done.end();
+
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			if (ranges[i].file != INVALID_HANDLE_VALUE) {
+				CloseHandle(ranges[i].file);
+			}
+		}
+
+		CloseHandle(file);
+
+		if (complete && hash.size()) {
+			actualHash = Sha256File(partPath);
+		}
+	}
+	else {
+		sha256_t sha;
+		bool hashing = hash.size() && Sha256Init(sha);
+
+		download_range_t range;
+		range.file = file;
+		range.start = 0;
+		range.end = 0;
+		range.segment = false;
+		range.sha = hashing ? &sha : NULL;
+
+		complete = HttpDownloadRange(urls, ranking[0], range, cancel);
+
+		CloseHandle(file);
+
+		if (range.sha) {
+			actualHash = Sha256Final(sha);
+		}
+		else if (hashing) {
+			complete = false;
+		}
+	}
+
+	if (!complete) {
+		DeleteFile(partPath.c_str());
+		return DOWNLOAD_FAILED;
+	}
+
+	if (hash.size() && actualHash != hash) {
+		DeleteFile(partPath.c_str());
+		return DOWNLOAD_HASH_MISMATCH;
+	}
+
+	if (useStore) {
+		StatsIncrement(g_stats.storeMisses);
+
+		return ComponentStoreCommit(partPath, hash, path) ? DOWNLOAD_OK : DOWNLOAD_FAILED;
+	}
+
+	if (!MoveFileEx(partPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFile(partPath.c_str());
+		return DOWNLOAD_FAILED;
+	}
+
+	return DOWNLOAD_OK;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Telemetry
+///////////////////////////////////////////////////////////////////////
+
+// Optionally, the HttpGetStats JSON is POSTed to a telemetry endpoint every
+// so often, set with HttpSetStatsTelemetry. Workers check whether it's due
+// between tasks; the one that claims the slot queues the event as a
+// background request that expires when the next one is due.
+static tstring g_configTelemetryUrl;
+static std::mutex g_configTelemetryUrlMutex;
+static std::atomic<ULONGLONG> g_configTelemetryIntervalMilliseconds(0); // 0 when disabled
+static std::atomic<ULONGLONG> g_telemetryNextTicks(0);
+
+static std::string StatsToJson()
+{
+	std::string tls = "{";
+	JsonAppendField(tls, "handshakes", StatsGet(g_stats.tlsHandshakes));
+	JsonAppendField(tls, "connections_reused", StatsGet(g_stats.tlsConnectionsReused));
+	tls += "}";
+
+	std::string queue = "{";
+	JsonAppendField(queue, "depth", (unsigned long long)g_taskQueueDepth);
+	JsonAppendField(queue, "capacity", (unsigned long long)g_configTaskQueueCapacity);
+	JsonAppendField(queue, "dropped_oldest", StatsGet(g_stats.queueDroppedOldest));
+	JsonAppendField(queue, "rejected", StatsGet(g_stats.queueRejected));
+	JsonAppendField(queue, "spilled", StatsGet(g_stats.queueSpilled));
+	JsonAppendField(queue, "parked_by_host_limit", (unsigned long long)g_hostParkedTasks);
+	JsonAppendField(queue, "host_rate_throttled", StatsGet(g_stats.hostRateThrottled));
+	JsonAppendField(queue, "host_rate_retries", StatsGet(g_stats.hostRateRetries));
+	JsonAppendField(queue, "task_heap_allocations", StatsGet(g_stats.taskHeapAllocations));
+	JsonAppendField(queue, "local_pending", (unsigned long long)g_localTasksPending);
+	JsonAppendField(queue, "local_spawned", StatsGet(g_stats.tasksSpawnedLocal));
+	JsonAppendField(queue, "stolen", StatsGet(g_stats.tasksStolen));
+	JsonAppendField(queue, "expired", StatsGet(g_stats.tasksExpired));
+	JsonAppendField(queue, "cancelled", StatsGet(g_stats.tasksCancelled));
+	JsonAppendField(queue, "dequeued_critical", StatsGet(g_stats.queueDequeued[TASK_PRIORITY_CRITICAL]));
+	JsonAppendField(queue, "dequeued_normal", StatsGet(g_stats.queueDequeued[TASK_PRIORITY_NORMAL]));
+	JsonAppendField(queue, "dequeued_background", StatsGet(g_stats.queueDequeued[TASK_PRIORITY_BACKGROUND]));
+	queue += "}";
+
+	unsigned long long cacheHits = StatsGet(g_stats.cacheHits);
+	unsigned long long cacheRevalidated = StatsGet(g_stats.cacheRevalidated);
+	unsigned long long cacheLookups = cacheHits + cacheRevalidated + StatsGet(g_stats.cacheMisses);
+
+	std::string cache = "{";
+	JsonAppendField(cache, "hits", cacheHits);
+	JsonAppendField(cache, "revalidated", cacheRevalidated);
+	JsonAppendField(cache, "misses", StatsGet(g_stats.cacheMisses));
+	JsonAppendField(cache, "hit_ratio", std::to_string(cacheLookups ? (double)(cacheHits + cacheRevalidated) / cacheLookups : 0.0));
+	JsonAppendField(cache, "bytes_saved", StatsGet(g_stats.cacheBytesSaved));
+	cache += "}";
+
+	std::string store = "{";
+	JsonAppendField(store, "hits", StatsGet(g_stats.storeHits));
+	JsonAppendField(store, "misses", StatsGet(g_stats.storeMisses));
+	store += "}";
+
+	std::string hedging = "{";
+	JsonAppendField(hedging, "requests", (unsigned long long)g_hedgeRequests);
+	JsonAppendField(hedging, "hedges", (unsigned long long)g_hedgesIssued);
+	JsonAppendField(hedging, "hedge_wins", StatsGet(g_stats.hedgeWins));
+	JsonAppendField(hedging, "delay_ms", (unsigned long long)HedgeDelay());
+	hedging += "}";
+
+	std::string mirrors = "{";
+	JsonAppendField(mirrors, "failovers", StatsGet(g_stats.mirrorFailovers));
+	JsonAppendField(mirrors, "segmented_downloads", StatsGet(g_stats.segmentedDownloads));
+	mirrors += "}";
+
+	std::string counters = "{";
+	JsonAppendField(counters, "requests", StatsGet(g_stats.requests));
+	JsonAppendField(counters, "bytes_sent", StatsGet(g_stats.bytesSent));
+	JsonAppendField(counters, "bytes_received", StatsGet(g_stats.bytesReceived));
+	JsonAppendField(counters, "errors_transport", StatsGet(g_stats.errorsTransport));
+	JsonAppendField(counters, "errors_4xx", StatsGet(g_stats.errorsClient));
+	JsonAppendField(counters, "errors_5xx", StatsGet(g_stats.errorsServer));
+	// Requests sent again: 429s put back in the queue and mirror failovers
+	JsonAppendField(counters, "retries", StatsGet(g_stats.hostRateRetries) + StatsGet(g_stats.mirrorFailovers));
+	JsonAppendField(counters, "queue_depth_high_water", StatsGet(g_stats.queueDepthHighWater));
+	counters += "}";
+
+	std::string json = "{";
+	JsonAppendField(json, "tls", tls);
+	JsonAppendField(json, "queue", queue);
+	JsonAppendField(json, "cache", cache);
+	JsonAppendField(json, "store", store);
+	JsonAppendField(json, "single_flight_shared", StatsGet(g_stats.singleFlightShared));
+	JsonAppendField(json, "hedging", hedging);
+	JsonAppendField(json, "mirrors", mirrors);
+	JsonAppendField(json, "circuit_breakers", CircuitBreakersToJson());
+	JsonAppendField(json, "timing", TimingToJson());
+	JsonAppendField(json, "counters", counters);
+	JsonAppendField(json, "histograms", HistogramsToJson());
+	JsonAppendField(json, "concurrency", AdaptiveConcurrencyToJson(g_taskConsumers.size()));
+	json += "}";
+
+	return json;
+}
+
+static void TelemetryFlushIfDue()
+{
+	ULONGLONG interval = g_configTelemetryIntervalMilliseconds;
+
+	if (!interval || !g_taskConsumersKeepRunning) {
+		// Nothing pushed during a shutdown would be waited for, and a
+		// graceful one would keep finding new work to drain
+		return;
+	}
+
+	ULONGLONG now = GetTickCount64();
+	ULONGLONG due = g_telemetryNextTicks;
+
+	if (now < due || !g_telemetryNextTicks.compare_exchange_strong(due, now + interval)) {
+		return;
+	}
+
+	queued_request_t request;
+	request.priority = TASK_PRIORITY_BACKGROUND;
+	request.deadline = now + interval;
+	request.cancel = CancelTokenGet(TEXT(""));
+	request.rateLimit = 0;
+	request.attempts = 0;
+	request.queuedCounter = TimingNow();
+	request.verb = TEXT("POST");
+	request.headers = TEXT("Content-Type: application/json");
+	request.content = StatsToJson();
+
+	{
+		std::lock_guard<std::mutex> lock(g_configTelemetryUrlMutex);
+
+		request.url = g_configTelemetryUrl;
+	}
+
+	// Straight into the queue: a worker mustn't block on a full one
+	TaskQueuePush(HttpRequestTask(std::move(request)));
+}
+
+///////////////////////////////////////////////////////////////////////
+// API
+///////////////////////////////////////////////////////////////////////
+
+#define NSISFUNC(name) extern "C" void __declspec(dllexport) name(HWND hWndParent, int string_size, TCHAR* variables, stack_t** stacktop, extra_parameters* extra)
+
+static void HttpPostStringAsync(bool withOptions)
+{
+	auto url = popstring();
+	auto contentType = popstring();
+	auto postContent = popstring();
+	auto options = withOptions ? popstring() : NULL;
+
+	if (url && contentType && postContent) {
+		queued_request_t request;
+		request.priority = TASK_PRIORITY_NORMAL;
+		request.deadline = 0;
+		request.cancel = CancelTokenGet(TEXT(""));
+		request.rateLimit = 0;
+		request.attempts = 0;
+		request.queuedCounter = 0;
+		request.verb = TEXT("POST");
+		request.url = url;
+		request.headers = TEXT("Content-Type: "); request.headers += contentType;
+		request.content = tchar_to_utf8(postContent);
+
+		ParseRequestOptions(options, request);
+
+		pushstring(EnqueueResultToString(EnqueueRequest(std::move(request), NsisTaskProducer())));
+	}
+	else {
+		pushstring(TEXT("error"));
+	}
+
+	if (url) {
+		GlobalFree((HGLOBAL)url);
+	}
+	if (contentType) {
+		GlobalFree((HGLOBAL)contentType);
+	}
+	if (postContent) {
+		GlobalFree((HGLOBAL)postContent);
+	}
+	if (options) {
+		GlobalFree((HGLOBAL)options);
+	}
+}
+
+NSISFUNC(HttpPostString)
+{
+	EXDLL_INIT();
+
+	HttpPostStringAsync(false);
+}
+
+// Same as HttpPostString with an extra options argument,
+// e.g. "priority=critical" (critical, normal or background).
+NSISFUNC(HttpPostStringEx)
+{
+	EXDLL_INIT();
+
+	HttpPostStringAsync(true);
+}
+
+NSISFUNC(HttpPostStringWait)
+{
+	EXDLL_INIT();
+
+	auto url = popstring();
+	auto contentType = popstring();
+	auto postContent = popstring();
+
+	tstring result;
+
+	if (url && contentType && postContent) {
+		tstring request_headers = TEXT("Content-Type: "); request_headers += contentType;
+
+		result = HttpRequestWait(TEXT("POST"), url, request_headers.c_str(), tchar_to_utf8(postContent));
+	}
+
+	if (url) {
+		GlobalFree((HGLOBAL)url);
+	}
+	if (contentType) {
+		GlobalFree((HGLOBAL)contentType);
+	}
+	if (postContent) {
+		GlobalFree((HGLOBAL)postContent);
+	}
+
+	pushstring(result.c_str());
+}
+
+NSISFUNC(HttpGetStringWait)
+{
+	EXDLL_INIT();
+
+	auto url = popstring();
+	auto contentType = popstring();
+	auto postContent = popstring();
+
+	tstring result;
+
+	if (url && contentType && postContent) {
+		result = HttpRequestWait(TEXT("GET"), url, NULL, std::string());
+	}
+
+	if (url) {
+		GlobalFree((HGLOBAL)url);
+	}
+	if (contentType) {
+		GlobalFree((HGLOBAL)contentType);
+	}
+	if (postContent) {
+		GlobalFree((HGLOBAL)postContent);
+	}
+
+	pushstring(result.c_str());
+}
+
+NSISFUNC(HttpSetTimeouts)
+{
+	EXDLL_INIT();
+	
+	g_configConnectTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
+	g_configRequestTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
+	g_configResponseTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
+}
+
+// Races IPv6 against IPv4 once per dual-stack host, on direct connections
+// only, and shortens WinINet's connect timeout for that host accordingly.
+// Each race costs an extra TCP connect. Off by default.
+NSISFUNC(HttpSetHappyEyeballs)
+{
+	EXDLL_INIT();
+
+	g_configHappyEyeballs = popint() != 0;
+}
+
+NSISFUNC(HttpSetAsyncRequestsConcurrency)
+{
+	EXDLL_INIT();
+
+	int numWorkers = popint();
+
+	if (numWorkers > 0) {
+		AdaptiveConcurrencyDisable();
+		TaskConsumersInit(numWorkers);
+	}
+}
+
+NSISFUNC(HttpSetAsyncQueueLimit)
+{
+	EXDLL_INIT();
+
+	int capacity = popint();
+	auto policy = popstring();
+	int blockTimeoutMilliseconds = popint();
+
+	g_configTaskQueueCapacity = capacity > 0 ? capacity : 0;
+
+	if (policy) {
+		if (!_tcsicmp(policy, TEXT("drop-oldest"))) {
+			g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_DROP_OLDEST;
+		}
+		else if (!_tcsicmp(policy, TEXT("drop-newest"))) {
+			g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_DROP_NEWEST;
+		}
+		else if (!_tcsicmp(policy, TEXT("spill"))) {
+			g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_SPILL;
+		}
+		else {
+			g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_BLOCK;
+		}
+
+		GlobalFree((HGLOBAL)policy);
+	}
+
+	if (blockTimeoutMilliseconds >= 0) {
+		g_configTaskQueueBlockTimeoutMilliseconds = blockTimeoutMilliseconds;
+	}
+}
+
+// Limits requests to host ("*" for every host without a limit of its own)
+// to requestsPerSecond, with bursts of up to burst requests (default: one
+// second's worth). A rate of 0 removes the limit.
+NSISFUNC(HttpSetHostRateLimit)
+{
+	EXDLL_INIT();
+
+	auto host = popstring();
+	int requestsPerSecond = popint();
+	int burst = popint();
+
+	if (host) {
+		tstring hostName = host;
+
+		for (size_t i = 0; i < hostName.size(); ++i) {
+			hostName[i] = _totlower(hostName[i]);
+		}
+
+		HostScheduleSetRate(hostName, requestsPerSecond > 0 ? requestsPerSecond : 0, burst > 0 ? burst : 0);
+
+		GlobalFree((HGLOBAL)host);
+	}
+}
+
+NSISFUNC(HttpSetHostConcurrency)
+{
+	EXDLL_INIT();
+
+	auto host = popstring();
+	int limit = popint();
+
+	if (host) {
+		tstring hostName = host;
+
+		for (size_t i = 0; i < hostName.size(); ++i) {
+			hostName[i] = _totlower(hostName[i]);
+		}
+
+		HostScheduleSetLimit(hostName, limit > 0 ? limit : 0);
+
+		GlobalFree((HGLOBAL)host);
+	}
+}
+
+// Enables the response cache for HttpGetStringWait. An empty directory uses
+// %TEMP%\nsis-http-cache; a memory limit of 0 turns the cache off and a
+// disk limit of 0 keeps it in memory only.
+NSISFUNC(HttpSetResponseCache)
+{
+	EXDLL_INIT();
+
+	auto directory = popstring();
+	int memoryBytes = popint();
+	int diskBytes = popint();
+
+	tstring path = directory ? directory : TEXT("");
+
+	if (directory) {
+		GlobalFree((HGLOBAL)directory);
+	}
+
+	if (path.empty()) {
+		TCHAR tempPath[MAX_PATH];
+
+		if (GetTempPath(MAX_PATH, tempPath)) {
+			path = tempPath;
+			path += TEXT("nsis-http-cache");
+		}
+	}
+
+	if (path.size() && path.back() != TEXT('\\')) {
+		path += TEXT('\\');
+	}
+
+	if (diskBytes > 0 && path.size()) {
+		CreateDirectory(path.c_str(), NULL);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+		g_configHttpCacheDirectory = path;
+		g_configHttpCacheMemoryBytes = memoryBytes > 0 ? memoryBytes : 0;
+		g_configHttpCacheDiskBytes = diskBytes > 0 && path.size() ? diskBytes : 0;
+		g_httpCacheEnabled = g_configHttpCacheMemoryBytes > 0;
+
+		HttpCacheMemoryEvict();
+	}
+
+	pushstring(TEXT("ok"));
+}
+
+// Enables the content-addressed component store used by HttpDownloadFileWait.
+// An empty directory uses %LOCALAPPDATA%\nsis-http-store; a size limit of 0
+// turns the store off.
+NSISFUNC(HttpSetComponentStore)
+{
+	EXDLL_INIT();
+
+	auto directory = popstring();
+	auto maxBytes = popstring();
+
+	tstring path = directory ? directory : TEXT("");
+	unsigned long long limit = maxBytes ? _tcstoui64(maxBytes, NULL, 10) : 0;
+
+	if (directory) {
+		GlobalFree((HGLOBAL)directory);
+	}
+	if (maxBytes) {
+		GlobalFree((HGLOBAL)maxBytes);
+	}
+
+	if (path.empty()) {
+		TCHAR localAppData[MAX_PATH];
+
+		if (ExpandEnvironmentStrings(TEXT("%LOCALAPPDATA%\\nsis-http-store"), localAppData, MAX_PATH) && localAppData[0] != TEXT('%')) {
+			path = localAppData;
+		}
+	}
+
+	if (path.size() && path.back() != TEXT('\\')) {
+		path += TEXT('\\');
+	}
+
+	if (!limit || path.empty() || (!CreateDirectory(path.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)) {
+		g_configComponentStoreDirectory.clear();
+		pushstring(limit ? TEXT("error") : TEXT("ok"));
+		return;
+	}
+
+	// Named after the directory, so installers sharing a store share the lock
+	tstring lowerPath = path;
+
+	for (size_t i = 0; i < lowerPath.size(); ++i) {
+		lowerPath[i] = _totlower(lowerPath[i]);
+	}
+
+	if (g_componentStoreMutex) {
+		CloseHandle(g_componentStoreMutex);
+	}
+
+	// The store may be shared by installers running in other sessions (e.g.
+	// a service and a user), so the lock is global and any signed-in user
+	// may wait on and release it
+	tstring mutexName = TEXT("nsis-http-store-") + HashString(lowerPath);
+	SECURITY_ATTRIBUTES security;
+	security.nLength = sizeof(security);
+	security.lpSecurityDescriptor = NULL;
+	security.bInheritHandle = FALSE;
+
+	ConvertStringSecurityDescriptorToSecurityDescriptor(
+		TEXT("D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x00100001;;;AU)"), // SYNCHRONIZE | MUTEX_MODIFY_STATE
+		SDDL_REVISION_1,
+		&security.lpSecurityDescriptor,
+		NULL);
+
+	g_componentStoreMutex = CreateMutex(security.lpSecurityDescriptor ? &security : NULL, FALSE, (TEXT("Global\\") + mutexName).c_str());
+
+	if (!g_componentStoreMutex) {
+		// No access to the global namespace: at least serialize this session
+		g_componentStoreMutex = CreateMutex(NULL, FALSE, (TEXT("Local\\") + mutexName).c_str());
+	}
+
+	if (security.lpSecurityDescriptor) {
+		LocalFree(security.lpSecurityDescriptor);
+	}
+
+	g_configComponentStoreDirectory = path;
+	g_configComponentStoreMaxBytes = limit;
+
+	pushstring(TEXT("ok"));
+}
+
+// Downloads url to path, through the component store when a SHA-256 is
+// given. Pushes "ok", "error" or "hash-mismatch".
+NSISFUNC(HttpDownloadFileWait)
+{
+	EXDLL_INIT();
+
+	auto url = popstring();
+	auto path = popstring();
+	auto sha256 = popstring();
+
+	download_result_t result = DOWNLOAD_FAILED;
+
+	if (url && path && sha256) {
+		cancel_token_ptr_t cancel = CancelTokenGet(TEXT(""));
+
+		WaitRun([&]() {
+			result = HttpDownloadFile(std::vector<tstring>(1, tstring(url)), path, sha256, 1, cancel.get());
+		});
+	}
+
+	if (url) {
+		GlobalFree((HGLOBAL)url);
+	}
+	if (path) {
+		GlobalFree((HGLOBAL)path);
+	}
+	if (sha256) {
+		GlobalFree((HGLOBAL)sha256);
+	}
+
+	pushstring(result == DOWNLOAD_OK ? TEXT("ok") : result == DOWNLOAD_HASH_MISMATCH ? TEXT("hash-mismatch") : TEXT("error"));
+}
+
+// Like HttpDownloadFileWait, from a "|"-separated list of mirrors of the same
+// payload. The best mirror is picked from measured latency and throughput and
+// a failed transfer resumes on the next one. With segments above 1, large
+// payloads are fetched in that many parts in parallel across the mirrors.
+NSISFUNC(HttpDownloadFileMirrorsWait)
+{
+	EXDLL_INIT();
+
+	auto mirrors = popstring();
+	auto path = popstring();
+	auto sha256 = popstring();
+	int segments = popint();
+
+	download_result_t result = DOWNLOAD_FAILED;
+
+	if (mirrors && path && sha256) {
+		std::vector<tstring> urls;
+		tstring list = mirrors;
+		size_t start = 0;
+
+		while (start <= list.size()) {
+			size_t end = list.find(TEXT('|'), start);
+
+			if (end == tstring::npos) {
+				end = list.size();
+			}
+
+			if (end > start) {
+				urls.push_back(list.substr(start, end - start));
+			}
+
+			start = end + 1;
+		}
+
+		cancel_token_ptr_t cancel = CancelTokenGet(TEXT(""));
+
+		WaitRun([&]() {
+			result = HttpDownloadFile(urls, path, sha256, segments > 1 ? (segments < 16 ? segments : 16) : 1, cancel.get());
+		});
+	}
+
+	if (mirrors) {
+		GlobalFree((HGLOBAL)mirrors);
+	}
+	if (path) {
+		GlobalFree((HGLOBAL)path);
+	}
+	if (sha256) {
+		GlobalFree((HGLOBAL)sha256);
+	}
+
+	pushstring(result == DOWNLOAD_OK ? TEXT("ok") : result == DOWNLOAD_HASH_MISMATCH ? TEXT("hash-mismatch") : TEXT("error"));
+}
+
+// Hedges Wait GETs that haven't had a first byte by the given percentile of
+// recent time-to-first-byte, with at most budget percent extra requests.
+// A percentile of 0 turns hedging off. While the response cache is enabled
+// (HttpSetResponseCache) GETs go through the cache instead and are not
+// hedged.
+NSISFUNC(HttpSetHedging)
+{
+	EXDLL_INIT();
+
+	int percentile = popint();
+	int budgetPercent = popint();
+
+	g_configHedgePercentile = percentile > 0 && percentile < 100 ? percentile : 0;
+	g_configHedgeBudgetPercent = budgetPercent > 0 ? budgetPercent : 0;
+}
+
+// Caps the bandwidth of all transfers together and, while foreground
+// transfers are running, of background-priority ones, in bytes per second.
+// 0 removes a cap. Burst defaults to one second's worth of the global cap.
+// A background rate of 0 defaults to 10% of the global cap, and -1 leaves
+// background transfers uncapped; without either cap they never yield.
+NSISFUNC(HttpSetBandwidthLimit)
+{
+	EXDLL_INIT();
+
+	int globalRate = popint();
+	int burst = popint();
+	int backgroundRate = popint();
+
+	unsigned long long global = globalRate > 0 ? globalRate : 0;
+	unsigned long long background = backgroundRate > 0 ? backgroundRate : 0;
+
+	if (!backgroundRate && global) {
+		background = global * BANDWIDTH_DEFAULT_BACKGROUND_PERCENT / 100;
+		background = background ? background : 1;
+	}
+
+	TokenBucketSet(g_bandwidthGlobal, global, burst > 0 ? burst : 0);
+	TokenBucketSet(g_bandwidthBackground, background, 0);
+}
+
+// Enables the adaptive concurrency controller: starts max workers and lets
+// the controller decide how many of them run at once, between min and max.
+// A max of 0 returns to a fixed worker count.
+NSISFUNC(HttpSetAdaptiveConcurrency)
+{
+	EXDLL_INIT();
+
+	int minLimit = popint();
+	int maxLimit = popint();
+
+	if (maxLimit <= 0) {
+		AdaptiveConcurrencyDisable();
+		return;
+	}
+
+	if (minLimit <= 0) {
+		minLimit = 1;
+	}
+	if (minLimit > maxLimit) {
+		minLimit = maxLimit;
+	}
+
+	if (g_taskConsumers.size() != (size_t)maxLimit) {
+		TaskConsumersInit(maxLimit);
+	}
+
+	AdaptiveConcurrencyEnable(minLimit, maxLimit);
+}
+
+// Enables per-host circuit breakers: a host's breaker opens when at least
+// failurePercent of its last `window` requests failed, and stays open for
+// openSeconds before a probe request is let through. Policy "drop" discards
+// queued requests to a host whose breaker is open; "spool" (the default)
+// keeps them in the spool until it closes. A window of 0 turns breakers off.
+NSISFUNC(HttpSetCircuitBreaker)
+{
+	EXDLL_INIT();
+
+	int window = popint();
+	int failurePercent = popint();
+	int openSeconds = popint();
+	auto policy = popstring();
+
+	circuit_breaker_policy_t breakerPolicy = policy && !_tcsicmp(policy, TEXT("drop")) ? CIRCUIT_BREAKER_DROP : CIRCUIT_BREAKER_SPOOL;
+
+	if (policy) {
+		GlobalFree((HGLOBAL)policy);
+	}
+
+	CircuitBreakerConfigure(
+		window > 0 ? window : 0,
+		failurePercent > 0 && failurePercent <= 100 ? failurePercent : 50,
+		(ULONGLONG)(openSeconds > 0 ? openSeconds : 30) * 1000,
+		breakerPolicy);
+}
+
+NSISFUNC(HttpCancelRequests)
+{
+	EXDLL_INIT();
+
+	auto token = popstring();
+
+	if (!token) {
+		pushstring(TEXT("error"));
+		return;
+	}
+
+	CancelRequests(token);
+
+	GlobalFree((HGLOBAL)token);
+
+	pushstring(TEXT("ok"));
+}
+
+// Pushes the progress of the async request with the given id as JSON, or
+// "error" for an unknown id. A finished request is forgotten once read.
+NSISFUNC(HttpGetProgress)
+{
+	EXDLL_INIT();
+
+	auto id = popstring();
+
+	http_progress_ptr_t progress;
+
+	if (id) {
+		progress = ProgressFind(id);
+	}
+
+	if (!progress) {
+		pushstring(TEXT("error"));
+	}
+	else {
+		std::string json = ProgressToJson(*progress);
+
+		if (progress->state == PROGRESS_DONE || progress->state == PROGRESS_FAILED || progress->state == PROGRESS_DROPPED) {
+			std::lock_guard<std::mutex> lock(g_progressMutex);
+
+			auto it = g_progress.find(id);
+
+			if (it != g_progress.end() && it->second == progress) {
+				g_progress.erase(it);
+			}
+		}
+
+		pushstring(utf8_to_tstring(json).c_str());
+	}
+
+	if (id) {
+		GlobalFree((HGLOBAL)id);
+	}
+}
+
+NSISFUNC(HttpFlushAllAsyncRequests)
+{
+	EXDLL_INIT();
+
+	int numWorkers = g_taskConsumers.size();
+
+	TaskConsumersShutdown(true);
+
+	TraceDump();
+
+	TaskConsumersInit(numWorkers);
+}
+
+NSISFUNC(HttpPreconnect)
+{
+	EXDLL_INIT();
+
+	auto url = popstring();
+	int count = popint();
+
+	size_t maxParked = g_taskConsumers.size() ? g_taskConsumers.size() : 4;
+
+	if (count <= 0) {
+		count = 1;
+	}
+	if ((size_t)count > maxParked) {
+		count = (int)maxParked;
+	}
+
+	tstring hostName;
+	INTERNET_PORT port = 0;
+
+	if (!HttpUrlHost(url, hostName, port)) {
+		if (url) {
+			GlobalFree((HGLOBAL)url);
+		}
+
+		pushstring(TEXT("error"));
+		return;
+	}
+
+	tstring hostKey = HttpHostKey(hostName.c_str(), port);
+
+	if (!PreconnectIsWarm(hostKey, count)) {
+		// Each HEAD request runs on its own worker, so up to `count` of them
+		// are in flight at once and leave that many sockets in the pool.
+		tstring warmUrl = url;
+
+		for (int i = 0; i < count; ++i) {
+			EnqueueTask(task_t([=]() {
+				if (HttpRequest(TEXT("HEAD"), warmUrl.c_str())) {
+					PreconnectPark(hostKey, maxParked);
+				}
+			}, TASK_PRIORITY_NORMAL, hostName), NsisTaskProducer());
+		}
+	}
+
+	GlobalFree((HGLOBAL)url);
+
+	pushstring(TEXT("ok"));
+}
+
+NSISFUNC(HttpGetStats)
+{
+	EXDLL_INIT();
+
+	pushstring(utf8_to_tstring(StatsToJson()).c_str());
+}
+
+// Records the request pipeline into a ring buffer of maxEvents (default
+// 65536) and writes it to path as Chrome trace JSON on
+// HttpFlushAllAsyncRequests and on unload. An empty path stops recording;
+// the events recorded until then are still written to the last path.
+NSISFUNC(HttpSetTracing)
+{
+	EXDLL_INIT();
+
+	auto path = popstring();
+	int maxEvents = popint();
+
+	TraceConfigure(path ? path : TEXT(""), maxEvents > 0 ? maxEvents : 0);
+
+	if (path) {
+		GlobalFree((HGLOBAL)path);
+	}
+}
+
+// POSTs the HttpGetStats JSON to url every intervalSeconds, as a background
+// request. An interval of 0 stops it.
+NSISFUNC(HttpSetStatsTelemetry)
+{
+	EXDLL_INIT();
+
+	auto url = popstring();
+	int intervalSeconds = popint();
+
+	ULONGLONG interval = url && url[0] && intervalSeconds > 0 ? (ULONGLONG)intervalSeconds * 1000 : 0;
+
+	if (url) {
+		std::lock_guard<std::mutex> lock(g_configTelemetryUrlMutex);
+
+		g_configTelemetryUrl = url;
+
+		GlobalFree((HGLOBAL)url);
+	}
+
+	g_telemetryNextTicks = GetTickCount64() + interval;
+	g_configTelemetryIntervalMilliseconds = interval;
+}
+
+NSISFUNC(HttpSetUserAgent)
+{
+	const TCHAR* userAgent = popstring();
+
+	if (userAgent) {
+		g_userAgent = userAgent;
+
+		GlobalFree((HGLOBAL)userAgent);
+	}
+}
+
+NSISFUNC(GetSecondsSinceEpochStart)
+{
+	EXDLL_INIT();
+
+	std::time_t time = std::time(nullptr);
+
+#ifdef UNICODE
+	pushstring(std::to_wstring(time).c_str());
+#else
+	pushstring(std::to_string(time).c_str());
+#endif
+}
+
+BOOL WINAPI DllMain(
+	_In_ HINSTANCE hinstDLL,
+	_In_ DWORD     fdwReason,
+	_In_ LPVOID    lpvReserved
+)
+{
+	if (hinstDLL) {
+		gDllInstance = hinstDLL;
+	}
+
+	switch (fdwReason) {
+	case DLL_PROCESS_ATTACH:
+		break;
+	case DLL_PROCESS_DETACH:
+		TaskConsumersShutdown(true);
+		HttpSessionClose();
+		SpoolClose();
+		HistogramsFree();
+		TraceDump();
+
+		delete g_nsisTaskProducer;
+		g_nsisTaskProducer = NULL;
+		break;
+	}
+
+	return TRUE;
+}
+
+
+#ifdef TARGET_EXE
+///////////////////////////////////////////////////////////////////////
+// Test server
+///////////////////////////////////////////////////////////////////////
+
+// A local HTTP server on 127.0.0.1 for the checks and benchmarks run by the
+// EXE build. Each connection is served on a thread of its own by a handler
+// that gets the request head and the request's number (from 0) and returns
+// the raw response, so it may stall before answering. An empty response
+// leaves the connection open and unanswered until the server is stopped.
+// Every response closes its connection.
+typedef std::function<std::string(const std::string& head, unsigned int index)> test_handler_t;
+
+struct test_server_t {
+	SOCKET listener;
+	INTERNET_PORT port;
+	test_handler_t handler;
+	std::atomic<bool> stop;
+	std::atomic<unsigned int> requests;
+	std::thread acceptor;
+	std::mutex connectionsMutex;
+	std::vector<std::thread> connections;
+
+	test_server_t() : listener(INVALID_SOCKET), port(0), stop(false), requests(0) {}
+};
+
+static std::string TestResponse(int status, const std::string& headers, const std::string& body)
+{
+	return "HTTP/1.1 " + std::to_string(status) + " Test\r\nContent-Length: " + std::to_string(body.size()) +
+		"\r\nConnection: close\r\n" + headers + "\r\n" + body;
+}
+
+static void TestServerConnection(test_server_t* server, SOCKET client)
+{
+	std::string head;
+	char buffer[4096];
+	int received = 0;
+
+	while (head.find("\r\n\r\n") == std::string::npos && (received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+		head.append(buffer, received);
+	}
+
+	std::string response = server->handler(head, server->requests++);
+
+	if (response.empty()) {
+		while (!server->stop) {
+			Sleep(10);
+		}
+	}
+
+	for (size_t sent = 0; sent < response.size() && !server->stop;) {
+		int chunk = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+
+		if (chunk <= 0) {
+			break;
+		}
+
+		sent += chunk;
+	}
+
+	closesocket(client);
+}
+
+static bool TestServerStart(test_server_t& server, test_handler_t handler)
+{
+	if (!WinsockInit()) {
+		return false;
+	}
+
+	server.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (server.listener == INVALID_SOCKET) {
+		return false;
+	}
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0; // any free port
+
+	int addressSize = sizeof(address);
+
+	if (bind(server.listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(server.listener, SOMAXCONN) != 0 ||
+		getsockname(server.listener, (sockaddr*)&address, &addressSize) != 0) {
+		closesocket(server.listener);
+		server.listener = INVALID_SOCKET;
+		return false;
+	}
+
+	server.port = ntohs(address.sin_port);
+	server.handler = handler;
+	server.stop = false;
+	server.requests = 0;
+
+	test_server_t* serverPtr = &server;
+
+	server.acceptor = std::thread([serverPtr]() {
+		while (!serverPtr->stop) {
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(serverPtr->listener, &readable);
+
+			timeval timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 50 * 1000;
+
+			if (select(0, &readable, NULL, NULL, &timeout) <= 0) {
+				continue;
+			}
+
+			SOCKET client = accept(serverPtr->listener, NULL, NULL);
+
+			if (client != INVALID_SOCKET) {
+				std::lock_guard<std::mutex> lock(serverPtr->connectionsMutex);
+
+				serverPtr->connections.emplace_back(TestServerConnection, serverPtr, client);
+			}
+		}
+	});
+
+	return true;
+}
+
+static void TestServerStop(test_server_t& server)
+{
+	server.stop = true;
+
+	if (server.acceptor.joinable()) {
+		server.acceptor.join();
+	}
+
+	for (size_t i = 0; i < server.connections.size(); ++i) {
+		server.connections[i].join();
+	}
+
+	server.connections.clear();
+
+	if (server.listener != INVALID_SOCKET) {
+		closesocket(server.listener);
+		server.listener = INVALID_SOCKET;
+	}
+}
+
+static tstring TestServerUrl(const test_server_t& server, const TCHAR* path)
+{
+	return TEXT("http://127.0.0.1:") + to_tstring(server.port) + path;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Benchmarks
+///////////////////////////////////////////////////////////////////////
+
+// Micro-benchmarks run by the EXE build. They print their results and are
+// meant for comparing builds on the same machine, not as pass/fail tests.
+static double BenchmarkSeconds(LONGLONG start)
+{
+	return (double)(TimingNow() - start) / TimingFrequency();
+}
+
+// Queues tasks that carry a request descriptor, as HttpRequestTask's do,
+// from one thread to four workers, and reports the enqueue cost, the end to
+// end throughput and how many of the tasks didn't fit the inline storage.
+static void BenchmarkTaskQueue()
+{
+	const size_t TASKS = 1000000;
+
+	queued_request_t request;
+	request.priority = TASK_PRIORITY_NORMAL;
+	request.deadline = 0;
+	request.rateLimit = 0;
+	request.attempts = 0;
+	request.queuedCounter = 0;
+	request.verb = TEXT("GET");
+	request.url = TEXT("http://127.0.0.1/");
+
+	std::atomic<size_t> done(0);
+	task_producer_t producer;
+
+	TaskConsumersInit(4);
+
+	unsigned long long allocations = StatsGet(g_stats.taskHeapAllocations);
+	LONGLONG start = TimingNow();
+
+	for (size_t i = 0; i < TASKS; ++i) {
+		queued_request_t captured = request;
+
+		EnqueueTask(task_t([&done, captured = std::move(captured)]() {
+			++done;
+		}), &producer);
+	}
+
+	double enqueueSeconds = BenchmarkSeconds(start);
+
+	while (done < TASKS) {
+		std::this_thread::yield();
+	}
+
+	double seconds = BenchmarkSeconds(start);
+
+	allocations = StatsGet(g_stats.taskHeapAllocations) - allocations;
+
+	TaskConsumersShutdown(true);
+
+	printf("task queue: %.0f ns per enqueue, %.0f tasks/s, %.3f heap allocations per task\n",
+		enqueueSeconds * 1e9 / TASKS, TASKS / seconds, (double)allocations / TASKS);
+}
+
+// Pushes empty tasks from several threads at once, each with its own
+// producer token, through four workers and reports the throughput.
+static void BenchmarkTaskQueueProducers(size_t producers)
+{
+	const size_t TASKS = 1000000;
+	size_t perProducer = TASKS / producers;
+
+	std::atomic<size_t> done(0);
+	std::vector<std::thread> threads;
+
+	TaskConsumersInit(4);
+
+	LONGLONG start = TimingNow();
+
+	for (size_t i = 0; i < producers; ++i) {
+		threads.emplace_back([&done, perProducer]() {
+			task_producer_t producer;
+
+			for (size_t n = 0; n < perProducer; ++n) {
+				EnqueueTask(task_t([&done]() {
+					++done;
+				}), &producer);
+			}
+		});
+	}
+
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+
+	while (done < perProducer * producers) {
+		std::this_thread::yield();
+	}
+
+	double seconds = BenchmarkSeconds(start);
+
+	TaskConsumersShutdown(true);
+
+	printf("task queue, %u producers: %.0f tasks/s\n", (unsigned int)producers, perProducer * producers / seconds);
+}
+
+// Records into one host's histograms from `threads` threads at once, as
+// workers finishing requests to the same host do, and reports the cost of a
+// HistogramRecord call.
+static void BenchmarkHistogramRecord(size_t threads)
+{
+	static const size_t RECORDS = 1000000;
+
+	host_histograms_t* histograms = HostHistogramsGet(TEXT("benchmark:80"));
+	std::vector<std::thread> recorders;
+	std::atomic<bool> go(false);
+
+	for (size_t i = 0; i < threads; ++i) {
+		recorders.emplace_back([histograms, &go, i]() {
+			while (!go) {
+				std::this_thread::yield();
+			}
+
+			for (size_t n = 0; n < RECORDS; ++n) {
+				// Spread over the buckets like real latencies, 1 us to ~1 s
+				HistogramRecord(histograms, HISTOGRAM_SERIES_TOTAL, ((n * 2654435761u + i) & 0xfffff) + 1);
+			}
+		});
+	}
+
+	LONGLONG start = TimingNow();
+
+	go = true;
+
+	for (size_t i = 0; i < recorders.size(); ++i) {
+		recorders[i].join();
+	}
+
+	double seconds = BenchmarkSeconds(start);
+
+	printf("histogram record, %u threads: %.1f ns per call\n", (unsigned int)threads, seconds * 1e9 / RECORDS);
+}
+
+// Latency at the given percentile of the samples, which get sorted
+static double BenchmarkPercentile(std::vector<double>& samples, int percentile)
+{
+	std::sort(samples.begin(), samples.end());
+
+	size_t index = samples.size() * percentile / 100;
+
+	return samples[index < samples.size() ? index : samples.size() - 1];
+}
+
+// GETs from a server that stalls one response in twenty for a second, once
+// plainly and once hedged at the 90th percentile of time to first byte,
+// and reports the median and 99th percentile latency of both.
+static void BenchmarkHedging()
+{
+	static const int REQUESTS = 200;
+
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int index) {
+		Sleep(index % 20 == 7 ? 1000 : 5);
+		return TestResponse(200, "", "ok");
+	})) {
+		return;
+	}
+
+	tstring url = TestServerUrl(server, TEXT("/"));
+	std::vector<double> plain, hedged;
+
+	for (int i = 0; i < REQUESTS; ++i) {
+		std::string body;
+		LONGLONG start = TimingNow();
+
+		HttpRequest(
+			TEXT("GET"),
+			url.c_str(),
 			NULL, // user-agent
-			NULL, // request_headers.c_str(),
-			0, // request_headers.size(),
-			NULL, // request_content.c_str(),
-			0, // request_content.size(),
+			NULL,
+			0,
+			NULL,
+			0,
 			[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
-				response_buffer.append((char*)buffer, buffer_len);
+				body.append((const char*)buffer, buffer_len);
+				return true;
+			});
+
+		plain.push_back(BenchmarkSeconds(start) * 1000);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_hedgeMutex);
+
+		g_hedgeFirstByteSamples.clear();
+	}
+
+	g_configHedgePercentile = 90;
+	g_configHedgeBudgetPercent = 10;
+
+	unsigned long long hedges = g_hedgesIssued;
+
+	for (int i = 0; i < REQUESTS; ++i) {
+		std::string body;
+		LONGLONG start = TimingNow();
+
+		HttpHedgedGet(url.c_str(), url.c_str(), NULL, body);
+
+		hedged.push_back(BenchmarkSeconds(start) * 1000);
+	}
+
+	g_configHedgePercentile = 0;
+
+	TestServerStop(server);
+
+	printf("hedging, 5%% stalled: plain p50 %.1f ms p99 %.1f ms, hedged p50 %.1f ms p99 %.1f ms, %u hedges\n",
+		BenchmarkPercentile(plain, 50), BenchmarkPercentile(plain, 99),
+		BenchmarkPercentile(hedged, 50), BenchmarkPercentile(hedged, 99),
+		(unsigned int)(g_hedgesIssued - hedges));
+}
+
+// Times the phases of a request the way HttpRequest does, a start and an
+// end reading per phase and the sums added to the totals, and reports what
+// that costs a request next to the cost of a bare TimingNow() call.
+static void BenchmarkTiming()
+{
+	static const size_t REQUESTS = 1000000;
+
+	LONGLONG start = TimingNow();
+	volatile LONGLONG reading = 0; // kept, so the reads aren't optimized away
+
+	for (size_t n = 0; n < REQUESTS; ++n) {
+		reading = TimingNow();
+	}
+
+	double readSeconds = BenchmarkSeconds(start);
+
+	start = TimingNow();
+
+	for (size_t n = 0; n < REQUESTS; ++n) {
+		http_request_context_t context = {};
+
+		for (int phase = 0; phase < HTTP_PHASE_COUNT; ++phase) {
+			HttpContextPhaseStart(&context, (http_phase_t)phase, TimingNow());
+			HttpContextPhaseEnd(&context, (http_phase_t)phase, TimingNow());
+		}
+
+		TimingRecord(context.timing, NULL);
+	}
+
+	double seconds = BenchmarkSeconds(start);
+
+	printf("request timing: %.1f ns per request, %.1f ns per counter read\n", seconds * 1e9 / REQUESTS, readSeconds * 1e9 / REQUESTS);
+}
+
+// Records a phase the way HttpContextPhaseEnd does, first with tracing off
+// and then on, into a ring buffer that wraps many times over, and reports
+// the cost of each. The trace is never written out.
+static void BenchmarkTrace()
+{
+	static const size_t EVENTS = 1000000;
+
+	const char* url = "http://benchmark/trace";
+
+	for (int enabled = 0; enabled < 2; ++enabled) {
+		if (enabled) {
+			TraceConfigure(TEXT("benchmark-trace.json"), 4096);
+		}
+
+		LONGLONG start = TimingNow();
+
+		for (size_t n = 0; n < EVENTS; ++n) {
+			if (TraceEnabled()) {
+				TraceComplete("transfer", start, start + n, n + 1, url);
+			}
+		}
+
+		double seconds = BenchmarkSeconds(start);
+
+		printf("trace complete, tracing %s: %.1f ns per call\n", enabled ? "on" : "off", seconds * 1e9 / EVENTS);
+	}
+
+	std::lock_guard<std::mutex> lock(g_traceConfigMutex);
+
+	g_traceEnabled = false;
+	g_configTracePath.clear();
+}
+
+///////////////////////////////////////////////////////////////////////
+// Tests
+///////////////////////////////////////////////////////////////////////
+
+// Checks run by the EXE build against the test server. Each prints a line
+// per check and returns false if any failed.
+static bool TestCheck(const char* name, bool passed)
+{
+	printf("%s: %s\n", name, passed ? "ok" : "FAILED");
+
+	return passed;
+}
+
+// Queues an async GET the way the Ex exports do, options included
+static enqueue_result_t TestQueueGet(const tstring& url, const TCHAR* options)
+{
+	queued_request_t request;
+	request.priority = TASK_PRIORITY_NORMAL;
+	request.deadline = 0;
+	request.cancel = CancelTokenGet(TEXT(""));
+	request.rateLimit = 0;
+	request.attempts = 0;
+	request.queuedCounter = 0;
+	request.verb = TEXT("GET");
+	request.url = url;
+
+	ParseRequestOptions(options, request);
+
+	return EnqueueRequest(std::move(request));
+}
+
+// The state HttpGetProgress reports for the request with the given id
+static std::string TestProgressState(const TCHAR* id)
+{
+	http_progress_ptr_t progress = ProgressFind(id);
+
+	if (!progress) {
+		return "unknown";
+	}
+
+	std::string json = ProgressToJson(*progress);
+	size_t start = json.find("\"state\":\"");
+
+	if (start == std::string::npos) {
+		return "unknown";
+	}
+
+	start += 9;
+
+	return json.substr(start, json.find('"', start) - start);
+}
+
+// Waits for the request with the given id to leave the queued and running
+// states and returns the state it ended in
+static std::string TestWaitProgress(const TCHAR* id, ULONGLONG timeoutMilliseconds)
+{
+	ULONGLONG startTicks = GetTickCount64();
+	std::string state = TestProgressState(id);
+
+	while ((state == "queued" || state == "running") && GetTickCount64() - startTicks < timeoutMilliseconds) {
+		Sleep(10);
+		state = TestProgressState(id);
+	}
+
+	return state;
+}
+
+// Runs requests against the test server. "localhost" usually resolves to
+// ::1 as well, where nothing listens, so the Happy Eyeballs race has an
+// IPv6 attempt that is refused and must fall back to IPv4.
+static bool TestLocalServer()
+{
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		return TestResponse(200, "", "hello");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	bool passed = true;
+	INTERNET_PORT port = server.port;
+	tstring url = TEXT("http://localhost:") + to_tstring(port) + TEXT("/");
+
+	// A dual-stack localhost must be won by IPv4; a single-stack one isn't raced
+	happy_eyeballs_entry_t entry;
+	bool raced = HappyEyeballsRace(TEXT("localhost"), port, AF_INET6, NULL, entry);
+
+	passed &= TestCheck("race falls back to IPv4",
+		raced && !entry.unreachable && (entry.family == AF_INET || entry.family == AF_UNSPEC));
+
+	g_configHappyEyeballs = true;
+
+	std::string body;
+	http_transfer_t transfer = { NULL, NULL, false, 0, false, 0 };
+	BOOL result = HttpRequest(
+		TEXT("GET"),
+		url.c_str(),
+		NULL, // user-agent
+		NULL,
+		0,
+		NULL,
+		0,
+		[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+			body.append((const char*)buffer, buffer_len);
+			return true;
+		},
+		NULL,
+		&transfer);
+
+	passed &= TestCheck("request", result && transfer.status == HTTP_STATUS_OK && body == "hello");
+
+	TaskConsumersInit(2);
+
+	TestQueueGet(url, TEXT("id=smoke-test"));
+
+	passed &= TestCheck("async request", TestWaitProgress(TEXT("smoke-test"), 10 * 1000) == "done");
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	// Nothing listens on either family now: a dual-stack race gives up on
+	// the refusals instead of waiting out the connect timeout
+	ULONGLONG startTicks = GetTickCount64();
+	raced = HappyEyeballsRace(TEXT("localhost"), port, AF_INET6, NULL, entry);
+
+	passed &= TestCheck("race to a closed port fails fast",
+		raced && (entry.unreachable || entry.family == AF_UNSPEC) &&
+		GetTickCount64() - startTicks < g_configConnectTimeoutMilliseconds);
+
+	g_configHappyEyeballs = false;
+
+	return passed;
+}
+
+// A request in flight to a server that never answers, and one queued
+// behind it on the same token, both end as soon as the token is cancelled
+// instead of waiting out the timeouts.
+static bool TestCancelRequests()
+{
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		return std::string();
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	bool passed = true;
+	tstring url = TestServerUrl(server, TEXT("/"));
+	unsigned long long cancelled = StatsGet(g_stats.tasksCancelled);
+
+	TaskConsumersInit(1);
+
+	TestQueueGet(url, TEXT("id=cancel-in-flight;cancel=test"));
+	TestQueueGet(url, TEXT("id=cancel-queued;cancel=test"));
+
+	ULONGLONG startTicks = GetTickCount64();
+
+	while (!server.requests && GetTickCount64() - startTicks < 5000) {
+		Sleep(10);
+	}
+
+	startTicks = GetTickCount64();
+
+	CancelRequests(TEXT("test"));
+
+	std::string queued = TestWaitProgress(TEXT("cancel-queued"), 10 * 1000);
+	std::string inFlight = TestWaitProgress(TEXT("cancel-in-flight"), 10 * 1000);
+	ULONGLONG elapsed = GetTickCount64() - startTicks;
+
+	passed &= TestCheck("cancel queued request", queued == "cancelled");
+	passed &= TestCheck("cancel request in flight", inFlight == "cancelled");
+	passed &= TestCheck("cancel ends requests before the timeouts",
+		elapsed < 1000 && elapsed < g_configResponseTimeoutMilliseconds);
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	passed &= TestCheck("cancelled task discarded unsent",
+		server.requests == 1 && StatsGet(g_stats.tasksCancelled) == cancelled + 1);
+
+	return passed;
+}
+
+static circuit_state_t TestCircuitState(const tstring& hostKey)
+{
+	std::lock_guard<std::mutex> lock(g_circuitBreakersMutex);
+
+	auto it = g_circuitBreakers.find(hostKey);
+
+	return it != g_circuitBreakers.end() ? it->second.state : CIRCUIT_CLOSED;
+}
+
+// Drives a host's breaker through its states against a server that answers
+// 503 until it is made healthy: the breaker opens once the window is full
+// of failures, requests queued while it is open are spooled without being
+// sent, and after the cool-off a single probe closes it again, after which
+// the spooled requests are replayed.
+static bool TestCircuitBreaker()
+{
+	test_server_t server;
+	std::atomic<bool> healthy(false);
+	std::atomic<unsigned int> halfOpenRequests(0);
+	tstring hostKey;
+
+	if (!TestServerStart(server, [&](const std::string&, unsigned int) {
+		if (!healthy) {
+			return TestResponse(503, "", "");
+		}
+
+		if (TestCircuitState(hostKey) == CIRCUIT_HALF_OPEN) {
+			++halfOpenRequests;
+			// Keep the probe out long enough for other workers to try
+			Sleep(200);
+		}
+
+		return TestResponse(200, "", "ok");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	bool passed = true;
+	tstring url = TestServerUrl(server, TEXT("/"));
+	unsigned long long trips = StatsGet(g_stats.circuitBreakerTrips);
+	unsigned long long spooled = StatsGet(g_stats.circuitBreakerSpooled);
+
+	hostKey = HttpUrlHostKey(url.c_str());
+
+	CircuitBreakerConfigure(5, 50, 500, CIRCUIT_BREAKER_SPOOL);
+	TaskConsumersInit(2);
+
+	for (int i = 0; i < 5; ++i) {
+		tstring id = TEXT("breaker-fail-") + to_tstring(i);
+
+		TestQueueGet(url, (TEXT("id=") + id).c_str());
+		TestWaitProgress(id.c_str(), 10 * 1000);
+	}
+
+	passed &= TestCheck("breaker opens at the threshold",
+		TestCircuitState(hostKey) == CIRCUIT_OPEN && StatsGet(g_stats.circuitBreakerTrips) == trips + 1);
+
+	unsigned int sent = server.requests;
+
+	for (int i = 0; i < 3; ++i) {
+		TestQueueGet(url, (TEXT("id=breaker-spooled-") + to_tstring(i)).c_str());
+	}
+
+	ULONGLONG startTicks = GetTickCount64();
+
+	while (StatsGet(g_stats.circuitBreakerSpooled) < spooled + 3 && GetTickCount64() - startTicks < 5000) {
+		Sleep(10);
+	}
+
+	passed &= TestCheck("open breaker spools requests unsent",
+		StatsGet(g_stats.circuitBreakerSpooled) >= spooled + 3 && server.requests == sent);
+
+	healthy = true;
+
+	bool replayed = true;
+
+	for (int i = 0; i < 3; ++i) {
+		replayed &= TestWaitProgress((TEXT("breaker-spooled-") + to_tstring(i)).c_str(), 10 * 1000) == "done";
+	}
+
+	passed &= TestCheck("single half-open probe", halfOpenRequests == 1);
+	passed &= TestCheck("probe closes the breaker", TestCircuitState(hostKey) == CIRCUIT_CLOSED);
+	passed &= TestCheck("spooled requests replayed", replayed && StatsGet(g_stats.circuitBreakerTrips) == trips + 1);
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+	CircuitBreakerConfigure(0, 50, 30 * 1000, CIRCUIT_BREAKER_SPOOL);
+
+	return passed;
+}
+
+// A server that answers 429 and then 503, both with Retry-After: 1, before
+// it serves the request: the task is parked for each hold and retried
+// after it, and both throttles and retries are counted.
+static bool TestHostRateRetryAfter()
+{
+	test_server_t server;
+	ULONGLONG requestTicks[3] = { 0, 0, 0 };
+
+	if (!TestServerStart(server, [&](const std::string&, unsigned int index) {
+		if (index < 3) {
+			requestTicks[index] = GetTickCount64();
+		}
+
+		if (index == 0) {
+			return TestResponse(HTTP_STATUS_RATE_LIMITED, "Retry-After: 1\r\n", "");
+		}
+
+		if (index == 1) {
+			return TestResponse(HTTP_STATUS_SERVICE_UNAVAIL, "Retry-After: 1\r\n", "");
+		}
+
+		return TestResponse(200, "", "ok");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	bool passed = true;
+	unsigned long long throttled = StatsGet(g_stats.hostRateThrottled);
+	unsigned long long retries = StatsGet(g_stats.hostRateRetries);
+
+	TaskConsumersInit(2);
 
-				return true;
-			});
+	TestQueueGet(TestServerUrl(server, TEXT("/")), TEXT("id=rate-limited"));
+
+	passed &= TestCheck("throttled request retried", TestWaitProgress(TEXT("rate-limited"), 10 * 1000) == "done" && server.requests == 3);
+	// GetTickCount64 moves in steps of up to ~16 ms
+	passed &= TestCheck("retry waits out Retry-After",
+		requestTicks[1] - requestTicks[0] >= 980 && requestTicks[2] - requestTicks[1] >= 980);
+	passed &= TestCheck("throttles and retries counted",
+		StatsGet(g_stats.hostRateThrottled) == throttled + 2 && StatsGet(g_stats.hostRateRetries) == retries + 2);
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	return passed;
+}
+
+// Concurrent Wait GETs of the same URL share one request: the server,
+// which takes long enough to answer for all callers to have joined, sees
+// a single request and every caller gets its body.
+static bool TestSingleFlight()
+{
+	static const unsigned int CALLERS = 8;
+
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		Sleep(300);
+		return TestResponse(200, "", "shared");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	tstring url = TestServerUrl(server, TEXT("/"));
+	unsigned long long shared = StatsGet(g_stats.singleFlightShared);
+	std::vector<std::thread> callers;
+	std::atomic<unsigned int> bodies(0);
+
+	for (unsigned int i = 0; i < CALLERS; ++i) {
+		callers.emplace_back([&]() {
+			if (HttpRequestWait(TEXT("GET"), url.c_str(), NULL, std::string()) == TEXT("shared")) {
+				++bodies;
+			}
+		});
+	}
+
+	for (size_t i = 0; i < callers.size(); ++i) {
+		callers[i].join();
+	}
+
+	TestServerStop(server);
+
+	bool passed = true;
+
+	passed &= TestCheck("single flight sends one request", server.requests == 1 && bodies == CALLERS);
+	passed &= TestCheck("single flight shares with the others", StatsGet(g_stats.singleFlightShared) == shared + CALLERS - 1);
+
+	return passed;
+}
+
+// An HTTP date for a time_t, the inverse of HttpParseDate
+static std::string TestHttpDate(std::time_t time)
+{
+	ULARGE_INTEGER ticks;
+	ticks.QuadPart = (unsigned long long)time * 10000000ULL + 116444736000000000ULL;
+
+	FILETIME fileTime;
+	fileTime.dwLowDateTime = ticks.LowPart;
+	fileTime.dwHighDateTime = ticks.HighPart;
+
+	SYSTEMTIME systemTime;
+	TCHAR date[INTERNET_RFC1123_BUFSIZE + 1];
+
+	if (!FileTimeToSystemTime(&fileTime, &systemTime) ||
+		!InternetTimeFromSystemTime(&systemTime, INTERNET_RFC1123_FORMAT, date, sizeof(date))) {
+		return std::string();
+	}
+
+	return tchar_to_utf8(date);
+}
 
-		if (!bResult) {
-			result = TEXT("error");
+// Runs the cache's freshness and revalidation rules against a server that
+// counts the requests to each path:
+// - max-age keeps a response fresh
+// - Expires counts from the server's Date, not from the local clock, so a
+//   server clock an hour behind still gives a minute of freshness
+// - a no-cache response is revalidated with its ETag, and the 304 brings a
+//   new ETag and freshness that the entry takes over
+// - no-store responses are never served from the cache
+static bool TestResponseCache()
+{
+	test_server_t server;
+	std::atomic<unsigned int> maxAgeRequests(0), expiresRequests(0), revalidateRequests(0), noStoreRequests(0);
+	std::atomic<bool> conditional(false);
+
+	if (!TestServerStart(server, [&](const std::string& head, unsigned int) {
+		std::string path = head.substr(0, head.find("\r\n"));
+
+		if (path.find(" /max-age ") != std::string::npos) {
+			++maxAgeRequests;
+			return TestResponse(200, "Cache-Control: max-age=60\r\n", "max-age");
 		}
-		else {
-			result = utf8_to_tstring(response_buffer);
+
+		if (path.find(" /expires ") != std::string::npos) {
+			std::time_t serverNow = std::time(NULL) - 3600;
+
+			++expiresRequests;
+			return TestResponse(200, "Date: " + TestHttpDate(serverNow) + "\r\nExpires: " + TestHttpDate(serverNow + 60) + "\r\n", "expires");
+		}
+
+		if (path.find(" /revalidate ") != std::string::npos) {
+			++revalidateRequests;
+
+			if (head.find("If-None-Match: \"v1\"") != std::string::npos) {
+				conditional = true;
+				return TestResponse(HTTP_STATUS_NOT_MODIFIED, "ETag: \"v2\"\r\nCache-Control: max-age=60\r\n", "");
+			}
+
+			return TestResponse(200, "ETag: \"v1\"\r\nCache-Control: no-cache\r\n", "revalidate");
 		}
+
+		++noStoreRequests;
+		return TestResponse(200, "Cache-Control: no-store, max-age=60\r\nETag: \"v1\"\r\n", "no-store");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
 	}
 
-	if (url) {
-		GlobalFree((HGLOBAL)url);
+	{
+		std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+		g_configHttpCacheDirectory.clear();
+		g_configHttpCacheMemoryBytes = 1024 * 1024;
+		g_configHttpCacheDiskBytes = 0;
+		g_httpCacheEnabled = true;
 	}
-	if (contentType) {
-		GlobalFree((HGLOBAL)contentType);
+
+	bool passed = true;
+	std::string body;
+	std::time_t now = std::time(NULL);
+	unsigned long long revalidated = StatsGet(g_stats.cacheRevalidated);
+	tstring maxAgeUrl = TestServerUrl(server, TEXT("/max-age"));
+	tstring expiresUrl = TestServerUrl(server, TEXT("/expires"));
+	tstring revalidateUrl = TestServerUrl(server, TEXT("/revalidate"));
+	tstring noStoreUrl = TestServerUrl(server, TEXT("/no-store"));
+
+	HttpCacheGet(maxAgeUrl.c_str(), NULL, NULL, body);
+	HttpCacheGet(maxAgeUrl.c_str(), NULL, NULL, body);
+
+	passed &= TestCheck("cache serves max-age fresh", maxAgeRequests == 1 && body == "max-age");
+
+	HttpCacheGet(expiresUrl.c_str(), NULL, NULL, body);
+	HttpCacheGet(expiresUrl.c_str(), NULL, NULL, body);
+
+	passed &= TestCheck("cache dates Expires by the server's clock", expiresRequests == 1 && body == "expires");
+
+	HttpCacheGet(revalidateUrl.c_str(), NULL, NULL, body);
+	HttpCacheGet(revalidateUrl.c_str(), NULL, NULL, body);
+
+	passed &= TestCheck("cache revalidates with the ETag",
+		revalidateRequests == 2 && conditional && body == "revalidate" && StatsGet(g_stats.cacheRevalidated) == revalidated + 1);
+
+	http_cache_entry_t entry;
+
+	HttpCacheGet(revalidateUrl.c_str(), NULL, NULL, body);
+
+	passed &= TestCheck("304 updates the ETag and freshness",
+		revalidateRequests == 2 && body == "revalidate" &&
+		HttpCacheLookup(revalidateUrl, entry) && entry.etag == TEXT("\"v2\"") && entry.freshUntil >= now + 60);
+
+	HttpCacheGet(noStoreUrl.c_str(), NULL, NULL, body);
+	HttpCacheGet(noStoreUrl.c_str(), NULL, NULL, body);
+
+	passed &= TestCheck("cache skips no-store", noStoreRequests == 2 && body == "no-store");
+
+	{
+		std::lock_guard<std::mutex> lock(g_httpCacheMutex);
+
+		g_httpCacheEnabled = false;
+		g_configHttpCacheMemoryBytes = 0;
+
+		HttpCacheMemoryEvict();
 	}
-	if (postContent) {
-		GlobalFree((HGLOBAL)postContent);
+
+	TestServerStop(server);
+
+	return passed;
+}
+
+// Fills a queue of two with no workers running and overflows it under
+// each policy, then starts workers: what was queued and everything that
+// was spilled reaches the server, and the spill kept the queue bounded.
+static bool TestQueueOverflow()
+{
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		return TestResponse(200, "", "ok");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
 	}
 
-	pushstring(result.c_str());
+	bool passed = true;
+	tstring url = TestServerUrl(server, TEXT("/"));
+
+	g_configTaskQueueCapacity = 2;
+	g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_BLOCK;
+	g_configTaskQueueBlockTimeoutMilliseconds = 100;
+
+	TestQueueGet(url, TEXT("id=overflow-0"));
+	TestQueueGet(url, TEXT("id=overflow-1"));
+
+	ULONGLONG startTicks = GetTickCount64();
+	enqueue_result_t result = TestQueueGet(url, TEXT("id=overflow-blocked"));
+
+	passed &= TestCheck("block policy times out as queue-full",
+		!_tcscmp(EnqueueResultToString(result), TEXT("queue-full")) && GetTickCount64() - startTicks >= 90 &&
+		TestProgressState(TEXT("overflow-blocked")) == "dropped");
+
+	g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_DROP_NEWEST;
+	result = TestQueueGet(url, TEXT("id=overflow-newest"));
+
+	passed &= TestCheck("drop-newest policy rejects as queue-full",
+		!_tcscmp(EnqueueResultToString(result), TEXT("queue-full")) && TestProgressState(TEXT("overflow-newest")) == "dropped");
+
+	g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_DROP_OLDEST;
+	result = TestQueueGet(url, TEXT("id=overflow-2"));
+
+	passed &= TestCheck("drop-oldest policy evicts a queued request",
+		!_tcscmp(EnqueueResultToString(result), TEXT("dropped-oldest")) &&
+		(TestProgressState(TEXT("overflow-0")) == "dropped") != (TestProgressState(TEXT("overflow-1")) == "dropped"));
+
+	g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_SPILL;
+
+	bool spilled = true;
+
+	for (int i = 0; i < 8; ++i) {
+		result = TestQueueGet(url, (TEXT("id=overflow-spilled-") + to_tstring(i)).c_str());
+		spilled &= !_tcscmp(EnqueueResultToString(result), TEXT("spilled"));
+	}
+
+	passed &= TestCheck("spill policy spills", spilled && g_taskQueueDepth == 2);
+
+	TaskConsumersInit(2);
+
+	bool replayed = true;
+
+	for (int i = 0; i < 8; ++i) {
+		replayed &= TestWaitProgress((TEXT("overflow-spilled-") + to_tstring(i)).c_str(), 10 * 1000) == "done";
+	}
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	passed &= TestCheck("spilled requests replayed", replayed && server.requests == 10);
+
+	g_configTaskQueueCapacity = 0;
+	g_configTaskQueueOverflowPolicy = QUEUE_OVERFLOW_BLOCK;
+	g_configTaskQueueBlockTimeoutMilliseconds = 1000;
+
+	return passed;
 }
 
-NSISFUNC(HttpSetTimeouts)
+// GETs a body from the test server, returning the seconds it took, or a
+// negative value if the request failed
+static double TestTimedGet(const tstring& url, http_transfer_t* transfer, size_t expectedBytes)
 {
-	EXDLL_INIT();
-	
-	g_configConnectTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
-	g_configRequestTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
-	g_configResponseTimeoutMilliseconds = ((unsigned long)popint()) * 1000L;
+	size_t received = 0;
+	LONGLONG start = TimingNow();
+	BOOL result = HttpRequest(
+		TEXT("GET"),
+		url.c_str(),
+		NULL, // user-agent
+		NULL,
+		0,
+		NULL,
+		0,
+		[&](const TCHAR* headers, const void* buffer, const size_t buffer_len) -> bool {
+			received += buffer_len;
+			return true;
+		},
+		NULL,
+		transfer);
+	double seconds = (double)(TimingNow() - start) / TimingFrequency();
+
+	return result && received == expectedBytes ? seconds : -1;
 }
 
-NSISFUNC(HttpSetAsyncRequestsConcurrency)
+// A capped GET from a server that sends as fast as loopback allows takes
+// as long as the cap says, within a quarter, both for a per-request rate
+// and for the global cap. A bucket starts with a second's worth of tokens,
+// so the transfer is expected to take (size - rate) / rate.
+static bool TestBandwidthLimit()
 {
-	EXDLL_INIT();
+	static const size_t BODY_BYTES = 768 * 1024;
+	static const unsigned long long RATE = 256 * 1024;
 
-	int numWorkers = popint();
+	test_server_t server;
 
-	if (numWorkers > 0) {
-		TaskConsumersInit(numWorkers);
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		return TestResponse(200, "", std::string(BODY_BYTES, 'x'));
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
 	}
+
+	bool passed = true;
+	tstring url = TestServerUrl(server, TEXT("/"));
+	double expected = (double)(BODY_BYTES - RATE) / RATE;
+
+	double unlimited = TestTimedGet(url, NULL, BODY_BYTES);
+
+	passed &= TestCheck("uncapped transfer is fast", unlimited >= 0 && unlimited < expected / 4);
+
+	token_bucket_t bucket;
+	TokenBucketSet(bucket, RATE, 0);
+
+	http_transfer_t transfer = { NULL, &bucket, false, 0, false, 0 };
+	double seconds = TestTimedGet(url, &transfer, BODY_BYTES);
+
+	printf("per-request cap: %.2f s, expected %.2f s\n", seconds, expected);
+	passed &= TestCheck("per-request cap holds the rate", seconds >= expected * 0.75 && seconds <= expected * 1.25);
+
+	TokenBucketSet(g_bandwidthGlobal, RATE, 0);
+
+	seconds = TestTimedGet(url, NULL, BODY_BYTES);
+
+	TokenBucketSet(g_bandwidthGlobal, 0, 0);
+
+	printf("global cap: %.2f s, expected %.2f s\n", seconds, expected);
+	passed &= TestCheck("global cap holds the rate", seconds >= expected * 0.75 && seconds <= expected * 1.25);
+
+	TestServerStop(server);
+
+	return passed;
 }
 
-NSISFUNC(HttpFlushAllAsyncRequests)
+// Backlogs every priority class, then lets a single worker drain them and
+// checks that the classes were served 8:3:1 while all of them had work.
+static bool TestPriorityWeights()
 {
-	EXDLL_INIT();
+	static const int PER_CLASS = 120;
+	static const int WINDOW = 120; // ten turns of the weights
 
-	int numWorkers = g_taskConsumers.size();
+	std::mutex orderMutex;
+	std::vector<int> order;
+
+	for (int i = 0; i < PER_CLASS; ++i) {
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT; ++priority) {
+			EnqueueTask(task_t([priority, &orderMutex, &order]() {
+				std::lock_guard<std::mutex> lock(orderMutex);
+
+				order.push_back(priority);
+			}, priority));
+		}
+	}
 
+	TaskConsumersInit(1);
 	TaskConsumersShutdown(true);
 
-	TaskConsumersInit(numWorkers);
+	int served[TASK_PRIORITY_COUNT] = {};
+
+	for (size_t i = 0; i < order.size() && i < WINDOW; ++i) {
+		++served[order[i]];
+	}
+
+	printf("served while backlogged: %d critical, %d normal, %d background\n",
+		served[TASK_PRIORITY_CRITICAL], served[TASK_PRIORITY_NORMAL], served[TASK_PRIORITY_BACKGROUND]);
+
+	return TestCheck("classes served 8:3:1",
+		order.size() == PER_CLASS * TASK_PRIORITY_COUNT &&
+		served[TASK_PRIORITY_CRITICAL] == 80 && served[TASK_PRIORITY_NORMAL] == 30 && served[TASK_PRIORITY_BACKGROUND] == 10);
 }
 
-NSISFUNC(HttpSetUserAgent)
+// With one request at a time allowed to localhost, which answers in a
+// second, requests to 127.0.0.1 queued behind three for localhost all
+// finish while the first localhost request is still being answered and
+// the other two wait parked.
+static bool TestHostLimit()
 {
-	const TCHAR* userAgent = popstring();
+	std::atomic<int> slowActive(0);
+	std::atomic<int> slowPeak(0);
+	std::atomic<int> slowStarted(0);
 
-	if (userAgent) {
-		g_userAgent = userAgent;
+	test_server_t server;
 
-		GlobalFree((HGLOBAL)userAgent);
+	if (!TestServerStart(server, [&](const std::string& head, unsigned int) {
+		if (head.find("GET /slow") == std::string::npos) {
+			return TestResponse(200, "", "fast");
+		}
+
+		++slowStarted;
+		int active = ++slowActive;
+
+		int peak = slowPeak;
+
+		while (active > peak && !slowPeak.compare_exchange_weak(peak, active)) {
+		}
+
+		Sleep(1000);
+		--slowActive;
+
+		return TestResponse(200, "", "slow");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	static const int SLOW = 3;
+	static const int FAST = 4;
+
+	bool passed = true;
+	tstring slowUrl = TEXT("http://localhost:") + to_tstring(server.port) + TEXT("/slow");
+	tstring fastUrl = TestServerUrl(server, TEXT("/fast"));
+
+	HostScheduleSetLimit(TEXT("localhost"), 1);
+
+	for (int i = 0; i < SLOW; ++i) {
+		TestQueueGet(slowUrl, (TEXT("id=host-limit-slow-") + to_tstring(i)).c_str());
+	}
+
+	for (int i = 0; i < FAST; ++i) {
+		TestQueueGet(fastUrl, (TEXT("id=host-limit-fast-") + to_tstring(i)).c_str());
+	}
+
+	ULONGLONG startTicks = GetTickCount64();
+
+	TaskConsumersInit(4);
+
+	bool fastDone = true;
+
+	for (int i = 0; i < FAST; ++i) {
+		fastDone &= TestWaitProgress((TEXT("host-limit-fast-") + to_tstring(i)).c_str(), 10 * 1000) == "done";
+	}
+
+	ULONGLONG fastTicks = GetTickCount64() - startTicks;
+	int slowStartedThen = slowStarted;
+
+	passed &= TestCheck("host at its limit doesn't hold up other hosts",
+		fastDone && fastTicks < 900 && slowStartedThen == 1);
+
+	bool slowDone = true;
+
+	for (int i = 0; i < SLOW; ++i) {
+		slowDone &= TestWaitProgress((TEXT("host-limit-slow-") + to_tstring(i)).c_str(), 10 * 1000) == "done";
 	}
+
+	passed &= TestCheck("host limit holds", slowDone && slowPeak == 1);
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	HostScheduleSetLimit(TEXT("localhost"), 0);
+
+	return passed;
 }
 
-NSISFUNC(GetSecondsSinceEpochStart)
+// Queues `count` GETs of url with ids prefix-0, prefix-1, ... and waits for
+// them, returning how many ended in the expected state
+static int TestQueueAndWait(const tstring& url, const tstring& prefix, int count, const char* expected)
 {
-	EXDLL_INIT();
+	for (int i = 0; i < count; ++i) {
+		TestQueueGet(url, (TEXT("id=") + prefix + to_tstring(i)).c_str());
+	}
 
-	std::time_t time = std::time(nullptr);
+	int matched = 0;
 
-#ifdef UNICODE
-	pushstring(std::to_wstring(time).c_str());
-#else
-	pushstring(std::to_string(time).c_str());
-#endif
+	for (int i = 0; i < count; ++i) {
+		matched += TestWaitProgress((prefix + to_tstring(i)).c_str(), 30 * 1000) == expected;
+	}
+
+	return matched;
 }
 
-BOOL WINAPI DllMain(
-	_In_ HINSTANCE hinstDLL,
-	_In_ DWORD     fdwReason,
-	_In_ LPVOID    lpvReserved
-)
+// Grows the adaptive limit with a backlog of fast requests, then checks it
+// is cut once requests start failing, and again, after growing back, once
+// the server slows down.
+static bool TestAdaptiveConcurrency()
 {
-	if (hinstDLL) {
-		gDllInstance = hinstDLL;
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string& head, unsigned int) {
+		if (head.find("GET /slow") != std::string::npos) {
+			Sleep(200);
+		}
+
+		return TestResponse(200, "", "ok");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
 	}
 
-	switch (fdwReason) {
-	case DLL_PROCESS_ATTACH:
-		break;
-	case DLL_PROCESS_DETACH:
-		TaskConsumersShutdown(true);
-		break;
+	// Nothing listens on a port the OS just handed out and took back
+	test_server_t closed;
+
+	if (!TestServerStart(closed, [](const std::string&, unsigned int) {
+		return TestResponse(200, "", "");
+	})) {
+		TestServerStop(server);
+		return TestCheck("listen on 127.0.0.1", false);
 	}
 
-	return TRUE;
+	TestServerStop(closed);
+
+	static const size_t WORKERS = 8;
+
+	bool passed = true;
+	tstring fastUrl = TestServerUrl(server, TEXT("/fast"));
+
+	TaskConsumersInit(WORKERS);
+	AdaptiveConcurrencyEnable(1, WORKERS);
+
+	int done = TestQueueAndWait(fastUrl, TEXT("aimd-grow-"), 100, "done");
+	size_t grown = g_adaptiveConcurrencyLimit;
+
+	passed &= TestCheck("limit grows under a backlog", done == 100 && grown >= 3);
+
+	int failed = TestQueueAndWait(TestServerUrl(closed, TEXT("/")), TEXT("aimd-errors-"), 24, "failed");
+	size_t afterErrors = g_adaptiveConcurrencyLimit;
+
+	printf("adaptive limit: %u grown, %u after errors\n", (unsigned int)grown, (unsigned int)afterErrors);
+	passed &= TestCheck("errors cut the limit", failed == 24 && afterErrors < grown);
+
+	done = TestQueueAndWait(fastUrl, TEXT("aimd-regrow-"), 100, "done");
+	grown = g_adaptiveConcurrencyLimit;
+
+	done += TestQueueAndWait(TestServerUrl(server, TEXT("/slow")), TEXT("aimd-slow-"), 24, "done");
+	size_t afterLatency = g_adaptiveConcurrencyLimit;
+
+	printf("adaptive limit: %u grown, %u after slow responses\n", (unsigned int)grown, (unsigned int)afterLatency);
+	passed &= TestCheck("latency cuts the limit", done == 124 && afterLatency < grown);
+
+	AdaptiveConcurrencyDisable();
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	return passed;
 }
 
+// Requests whose ttl runs out while they wait in the queue are discarded
+// when a worker gets to them instead of being sent; one without a ttl
+// queued alongside still goes out.
+static bool TestExpiredRequests()
+{
+	test_server_t server;
+
+	if (!TestServerStart(server, [](const std::string&, unsigned int) {
+		return TestResponse(200, "", "ok");
+	})) {
+		return TestCheck("listen on 127.0.0.1", false);
+	}
+
+	static const int EXPIRING = 4;
+
+	bool passed = true;
+	tstring url = TestServerUrl(server, TEXT("/"));
+	unsigned long long expired = StatsGet(g_stats.tasksExpired);
+
+	for (int i = 0; i < EXPIRING; ++i) {
+		TestQueueGet(url, (TEXT("id=expiring-") + to_tstring(i) + TEXT(";ttl=100")).c_str());
+	}
+
+	TestQueueGet(url, TEXT("id=expiry-kept"));
+
+	Sleep(300);
+
+	bool reported = true;
+
+	for (int i = 0; i < EXPIRING; ++i) {
+		reported &= TestProgressState((TEXT("expiring-") + to_tstring(i)).c_str()) == "expired";
+	}
+
+	passed &= TestCheck("queued past ttl reported expired", reported);
+
+	TaskConsumersInit(2);
+
+	passed &= TestCheck("request without ttl sent", TestWaitProgress(TEXT("expiry-kept"), 10 * 1000) == "done");
+
+	TaskConsumersShutdown(true);
+	TestServerStop(server);
+
+	passed &= TestCheck("expired requests discarded unsent",
+		server.requests == 1 && StatsGet(g_stats.tasksExpired) == expired + EXPIRING);
+
+	return passed;
+}
+
+// Subtasks a task spawns into its worker's own deque are taken by idle
+// workers while the spawning task still holds its worker.
+static bool TestWorkStealing()
+{
+	static const int SUBTASKS = 32;
+
+	std::mutex threadsMutex;
+	std::vector<DWORD> subtaskThreads;
+	std::atomic<int> finished(0);
+	DWORD parentThread = 0;
+	unsigned long long stolen = StatsGet(g_stats.tasksStolen);
+
+	TaskConsumersInit(4);
+
+	EnqueueTask(task_t([&]() {
+		parentThread = GetCurrentThreadId();
+
+		for (int i = 0; i < SUBTASKS; ++i) {
+			SpawnLocalTask(task_t([&]() {
+				{
+					std::lock_guard<std::mutex> lock(threadsMutex);
+
+					subtaskThreads.push_back(GetCurrentThreadId());
+				}
+
+				Sleep(10);
+				++finished;
+			}));
+		}
+
+		// Keep this worker busy so only the others can run the subtasks
+		Sleep(200);
+	}));
+
+	ULONGLONG startTicks = GetTickCount64();
+
+	while (finished < SUBTASKS && GetTickCount64() - startTicks < 10 * 1000) {
+		Sleep(10);
+	}
+
+	TaskConsumersShutdown(true);
+
+	bool elsewhere = std::find_if(subtaskThreads.begin(), subtaskThreads.end(), [parentThread](DWORD thread) {
+		return thread != parentThread;
+	}) != subtaskThreads.end();
+
+	return TestCheck("idle workers steal spawned subtasks",
+		finished == SUBTASKS && elsewhere && StatsGet(g_stats.tasksStolen) > stolen);
+}
 
-#ifdef TARGET_EXE
 //
 // This is used only in "EXE Debug" configuration
 // for easy step-through debugging as an EXE.
 //
 int main(void)
 {
+	BenchmarkTaskQueue();
+	BenchmarkTaskQueueProducers(1);
+	BenchmarkTaskQueueProducers(4);
+	BenchmarkTaskQueueProducers(16);
+	BenchmarkHistogramRecord(1);
+	BenchmarkHistogramRecord(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() : 2);
+	BenchmarkHedging();
+	BenchmarkTiming();
+	BenchmarkTrace();
+
+	bool passed = true;
+
+	passed &= TestLocalServer();
+	passed &= TestCancelRequests();
+	passed &= TestCircuitBreaker();
+	passed &= TestHostRateRetryAfter();
+	passed &= TestSingleFlight();
+	passed &= TestResponseCache();
+	passed &= TestQueueOverflow();
+	passed &= TestBandwidthLimit();
+	passed &= TestPriorityWeights();
+	passed &= TestHostLimit();
+	passed &= TestAdaptiveConcurrency();
+	passed &= TestExpiredRequests();
+	passed &= TestWorkStealing();
+
+	if (!passed) {
+		return 1;
+	}
+
 	/*
 	{
 		std::string postData = "{ \"app_id\": \"3780144397\", \"identity\": \"1E1B8CEE-884E-4ED9-9359-DC5BA786836A\", \"event\": \"Test Server-Side API Event\", \"properties\": { } }";